@@ -0,0 +1,261 @@
+#include <iostream>
+#include <filesystem>
+#include <algorithm>
+#include <chrono>
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <optional>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <process.h>
+#define popen _popen
+#define pclose _pclose
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
+// generates a synthetic tree and times the phases of hrdups on it, every variant gets a fresh copy of the same tree:
+//
+//   hrdups_bench --files 20000 --duplicates 0.3 --variant "--io=read" --variant "--io=uring"
+
+#ifndef HRDUPS_BINARY
+#define HRDUPS_BINARY "hrdups"
+#endif
+
+enum class Distribution {
+	uniform,
+	log,
+};
+
+struct Tree {
+	unsigned long files = 10000;
+	uintmax_t min_size = 1;
+	uintmax_t max_size = 1024 * 1024;
+	Distribution distribution = Distribution::log;
+	double duplicates = 0.25;
+	unsigned long depth = 3;
+	unsigned long fanout = 8;
+	unsigned long seed = 1;
+};
+
+uintmax_t parse_size(const std::string& value) {
+	size_t end = 0;
+	const auto number = std::stod(value, &end);
+	const auto suffix = value.substr(end);
+	const std::string units = "KMGT";
+	if (suffix.empty()) {
+		return static_cast<uintmax_t>(number);
+	}
+	const auto shift = units.find(static_cast<char>(std::toupper(static_cast<unsigned char>(suffix[0]))));
+	if (shift == std::string::npos || (suffix.size() > 1 && suffix.substr(1) != "iB" && suffix.substr(1) != "B")) {
+		throw std::invalid_argument("invalid size " + value);
+	}
+	return static_cast<uintmax_t>(number * std::pow(1024.0, static_cast<double>(shift + 1)));
+}
+
+Distribution parse_distribution(const std::string& value) {
+	if (value == "uniform") {
+		return Distribution::uniform;
+	}
+	if (value == "log") {
+		return Distribution::log;
+	}
+	throw std::invalid_argument("unknown distribution " + value);
+}
+
+// the bytes of a file only depend on its content id, so a duplicate is written again instead of copied
+void write_content(const std::filesystem::path& path, uint64_t content, uintmax_t size) {
+	std::ofstream file(path, std::ofstream::binary | std::ofstream::trunc);
+	if (not file.good()) {
+		std::ostringstream os;
+		os << "Cannot create \"" << path.string() << "\": " << std::strerror(errno) << ".";
+		throw std::runtime_error(os.str());
+	}
+
+	std::mt19937_64 bytes(content);
+	std::vector<uint64_t> block(8192);
+	for (uintmax_t written = 0; written < size;) {
+		for (auto & word : block) {
+			word = bytes();
+		}
+		const auto chunk = std::min<uintmax_t>(size - written, block.size() * sizeof(uint64_t));
+		file.write(reinterpret_cast<const char *>(block.data()), static_cast<std::streamsize>(chunk));
+		written += chunk;
+	}
+}
+
+// directories form a tree of the given depth and fanout, files are spread over all of them
+uintmax_t generate(const std::filesystem::path& root, const Tree& tree) {
+	std::vector<std::filesystem::path> directories { root };
+	for (size_t level = 0, first = 0; level < tree.depth; level++) {
+		const auto last = directories.size();
+		for (auto i = first; i < last; i++) {
+			for (unsigned long n = 0; n < tree.fanout; n++) {
+				directories.push_back(directories[i] / ("d" + std::to_string(n)));
+			}
+		}
+		first = last;
+	}
+	for (const auto & directory : directories) {
+		std::filesystem::create_directories(directory);
+	}
+
+	std::mt19937_64 random(tree.seed);
+	std::uniform_real_distribution<double> unit(0, 1);
+	const auto size = [&] {
+		const auto min = static_cast<double>(std::max<uintmax_t>(tree.min_size, 1));
+		const auto max = static_cast<double>(std::max(tree.max_size, tree.min_size));
+		if (tree.distribution == Distribution::uniform) {
+			return static_cast<uintmax_t>(min + unit(random) * (max - min));
+		}
+		return static_cast<uintmax_t>(std::exp(std::log(min) + unit(random) * (std::log(max) - std::log(min))));
+	};
+
+	// a duplicate repeats the content and size of an earlier original
+	std::vector<std::pair<uint64_t, uintmax_t>> originals;
+	uintmax_t bytes = 0;
+	for (unsigned long i = 0; i < tree.files; i++) {
+		std::pair<uint64_t, uintmax_t> content;
+		if (!originals.empty() && unit(random) < tree.duplicates) {
+			content = originals[random() % originals.size()];
+		}
+		else {
+			content = { random(), size() };
+			originals.push_back(content);
+		}
+		write_content(directories[random() % directories.size()] / ("f" + std::to_string(i)), content.first, content.second);
+		bytes += content.second;
+	}
+	return bytes;
+}
+
+// runs hrdups with --stats and collects the "\t<phase>\t<seconds>s\t<seconds>s cpu" lines it prints
+std::vector<std::pair<std::string, double>> run(const std::string& binary, const std::filesystem::path& root, const std::string& variant) {
+#ifdef _WIN32
+	// cmd.exe strips the first and the last quote of the whole line
+	const auto command = "\"\"" + binary + "\" --stats --path \"" + root.string() + "\" " + variant + " 2>&1\"";
+#else
+	const auto command = "'" + binary + "' --stats --path '" + root.string() + "' " + variant + " 2>&1";
+#endif
+	std::FILE *pipe = ::popen(command.c_str(), "r");
+	if (!pipe) {
+		std::ostringstream os;
+		os << "Cannot run \"" << binary << "\": " << std::strerror(errno) << ".";
+		throw std::runtime_error(os.str());
+	}
+
+	std::vector<std::pair<std::string, double>> phases;
+	std::string output;
+	char line[4096];
+	while (std::fgets(line, sizeof(line), pipe)) {
+		output += line;
+		char phase[64];
+		double seconds;
+		double cpu;
+		if (line[0] == '\t' && std::sscanf(line, "\t%63s\t%lfs\t%lfs cpu", phase, &seconds, &cpu) == 3) {
+			phases.emplace_back(phase, seconds);
+		}
+	}
+
+	const auto status = ::pclose(pipe);
+	if (status != 0 || phases.empty()) {
+		std::ostringstream os;
+		os << "\"" << command << "\" failed:" << std::endl << output;
+		throw std::runtime_error(os.str());
+	}
+	return phases;
+}
+
+int main(int argc, char** argv) {
+
+	Tree tree;
+	std::string directory;
+	std::string hrdups(HRDUPS_BINARY);
+	unsigned long runs = 3;
+	std::vector<std::string> variants;
+	bool keep = false;
+
+	for (argv++, argc--; argc; argc--) {
+		// both "--name value" and "--name=value" are accepted
+		std::string option = *argv++;
+		std::optional<std::string> argument;
+		if (const auto equals = option.find('='); equals != std::string::npos) {
+			argument = option.substr(equals + 1);
+			option.resize(equals);
+		}
+		#define set_option_named(name, variable, conversion) if (option == "--" name) { if (!argument) { if (argc == 1) { throw std::invalid_argument("missing argument for --" name); } argument = *argv++; argc--; } variable = conversion(*argument); }
+		#define set_option(name, conversion) set_option_named(# name, name, conversion)
+		#define set_bool_option(name) if (option == "--" # name) { (name) = true; }
+		set_option_named("files", tree.files, std::stoul)
+		else set_option_named("min-size", tree.min_size, parse_size)
+		else set_option_named("max-size", tree.max_size, parse_size)
+		else set_option_named("distribution", tree.distribution, parse_distribution)
+		else set_option_named("duplicates", tree.duplicates, std::stod)
+		else set_option_named("depth", tree.depth, std::stoul)
+		else set_option_named("fanout", tree.fanout, std::stoul)
+		else set_option_named("seed", tree.seed, std::stoul)
+		else set_option(directory, std::string)
+		else set_option(hrdups, std::string)
+		else set_option(runs, std::stoul)
+		else set_option_named("variant", variants.emplace_back(), std::string)
+		else set_bool_option(keep)
+		else {
+			throw std::invalid_argument("unknown option " + option);
+		}
+		#undef set_option
+		#undef set_option_named
+		#undef set_bool_option
+	}
+
+	if (variants.empty()) {
+		variants.emplace_back();
+	}
+
+	// the tree is removed between runs, so it always lives in a directory of its own
+	const std::filesystem::path root = (directory.empty() ? std::filesystem::temp_directory_path() : std::filesystem::path(directory)) / ("hrdups-bench-" + std::to_string(::getpid()));
+
+	std::cout << std::fixed << std::setprecision(3);
+	for (const auto & variant : variants) {
+		// the fastest of the runs, a phase is only as slow as the machine makes it at its quietest
+		std::vector<std::pair<std::string, double>> best;
+		for (unsigned long n = 0; n < std::max(runs, 1ul); n++) {
+			// linking changes the tree, so every run starts from a fresh one
+			std::filesystem::remove_all(root);
+			const auto start = std::chrono::steady_clock::now();
+			const auto bytes = generate(root, tree);
+			if (n == 0 && &variant == &variants.front()) {
+				std::cout << "Generated " << tree.files << " files, " << (double)bytes / (1024 * 1024) << "MiB in "
+				          << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() << 's' << std::endl;
+			}
+
+			const auto phases = run(hrdups, root, variant);
+			if (best.empty()) {
+				best = phases;
+			}
+			for (size_t i = 0; i < std::min(best.size(), phases.size()); i++) {
+				best[i].second = std::min(best[i].second, phases[i].second);
+			}
+		}
+
+		std::cout << (variant.empty() ? "(defaults)" : variant);
+		for (const auto & [phase, seconds] : best) {
+			std::cout << '\t' << phase << ' ' << seconds << 's';
+		}
+		std::cout << std::endl;
+	}
+
+	if (!keep) {
+		std::filesystem::remove_all(root);
+	}
+	return 0;
+}
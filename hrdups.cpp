@@ -0,0 +1,4353 @@
+#include "hrdups.h"
+
+#include <filesystem>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cctype>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <openssl/evp.h>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <winioctl.h>
+#include <io.h>
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef HAVE_BLAKE3
+#include <blake3.h>
+#endif
+
+#ifdef HAVE_XXHASH
+#include <xxhash.h>
+#endif
+
+#ifdef __linux__
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#ifdef __APPLE__
+#include <sys/clonefile.h>
+#endif
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define HAVE_URING 1
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+
+namespace hrdups {
+
+namespace {
+
+// bounded multi-producer multi-consumer queue, push blocks while the queue is full
+template <typename T>
+class Queue {
+public:
+	explicit Queue(size_t capacity) : capacity(capacity) {}
+
+	void push(T item) {
+		std::unique_lock lock(mutex);
+		not_full.wait(lock, [this] { return items.size() < capacity; });
+		items.push_back(std::move(item));
+		not_empty.notify_one();
+	}
+
+	// never waits, for consumers that have other work pending
+	bool try_pop(T& item) {
+		std::lock_guard lock(mutex);
+		if (items.empty()) {
+			return false;
+		}
+		item = std::move(items.front());
+		items.pop_front();
+		not_full.notify_one();
+		return true;
+	}
+
+	// returns false once the queue is closed and drained
+	bool pop(T& item) {
+		std::unique_lock lock(mutex);
+		not_empty.wait(lock, [this] { return !items.empty() || closed; });
+		if (items.empty()) {
+			return false;
+		}
+		item = std::move(items.front());
+		items.pop_front();
+		not_full.notify_one();
+		return true;
+	}
+
+	void close() {
+		std::lock_guard lock(mutex);
+		closed = true;
+		not_empty.notify_all();
+	}
+
+	// drops what was not popped yet, items already taken are not affected
+	void discard() {
+		std::lock_guard lock(mutex);
+		items.clear();
+		not_full.notify_all();
+	}
+
+private:
+	const size_t capacity;
+	std::deque<T> items;
+	bool closed = false;
+	std::mutex mutex;
+	std::condition_variable not_empty;
+	std::condition_variable not_full;
+};
+
+// append-only storage for NUL terminated names, chunks never move so the returned pointers stay valid
+class Arena {
+public:
+	const char *intern(std::string_view name) {
+		if (name.size() + 1 > available) {
+			available = std::max<size_t>(chunk_size, name.size() + 1);
+			chunks.emplace_back(new char[available]);
+			next = chunks.back().get();
+		}
+
+		auto *result = next;
+		std::memcpy(result, name.data(), name.size());
+		result[name.size()] = '\0';
+		next += name.size() + 1;
+		available -= name.size() + 1;
+		return result;
+	}
+
+private:
+	static constexpr size_t chunk_size = 1 << 20;
+
+	std::vector<std::unique_ptr<char[]>> chunks;
+	char *next = nullptr;
+	size_t available = 0;
+};
+
+// a file as its parent directory and its interned name, the full path is only rebuilt to open or link it
+struct Path {
+	uint32_t directory;
+	const char *name;
+};
+
+// directory tree of everything walked, a directory is its parent id and its name
+class Paths {
+public:
+	static constexpr uint32_t none = UINT32_MAX;
+
+	// the entry is written before its id is handed out, readers get the id through the queue or a task deque
+	uint32_t add(uint32_t parent, const char *name) {
+		std::lock_guard lock(mutex);
+		const auto id = count++;
+		auto &chunk = chunks.at(id >> chunk_bits);
+		if (!chunk) {
+			chunk = std::make_unique<Directory[]>(size_t(1) << chunk_bits);
+		}
+		chunk[id & chunk_mask] = { parent, name };
+		return id;
+	}
+
+	std::filesystem::path directory(uint32_t id) const {
+		std::vector<const char *> names;
+		for (; id != none; id = chunks[id >> chunk_bits][id & chunk_mask].parent) {
+			names.push_back(chunks[id >> chunk_bits][id & chunk_mask].name);
+		}
+
+		std::filesystem::path result;
+		for (auto it = names.rbegin(); it != names.rend(); ++it) {
+#ifdef _WIN32
+			// names are interned as utf-8 whatever the code page
+			result /= std::filesystem::u8path(*it);
+#else
+			result /= *it;
+#endif
+		}
+		return result;
+	}
+
+	std::filesystem::path full(const Path& path) const {
+		return directory(path.directory) / path.name;
+	}
+
+	uint32_t parent(uint32_t id) const {
+		return chunks[id >> chunk_bits][id & chunk_mask].parent;
+	}
+
+	const char *name(uint32_t id) const {
+		return chunks[id >> chunk_bits][id & chunk_mask].name;
+	}
+
+	// walkers intern into their own arena so naming a file never takes a lock
+	Arena& arena() {
+		std::lock_guard lock(mutex);
+		return arenas.emplace_back();
+	}
+
+private:
+	struct Directory {
+		uint32_t parent;
+		const char *name;
+	};
+
+	static constexpr unsigned chunk_bits = 16;
+	static constexpr uint32_t chunk_mask = (1u << chunk_bits) - 1;
+
+	std::mutex mutex;
+	uint32_t count = 0;
+	std::array<std::unique_ptr<Directory[]>, (size_t(1) << (32 - chunk_bits))> chunks;
+	std::deque<Arena> arenas;
+};
+
+#ifdef _WIN32
+std::string narrow(std::wstring_view text) {
+	std::string result(::WideCharToMultiByte(CP_UTF8, 0, text.data(), static_cast<int>(text.size()), nullptr, 0, nullptr, nullptr), '\0');
+	::WideCharToMultiByte(CP_UTF8, 0, text.data(), static_cast<int>(text.size()), result.data(), static_cast<int>(result.size()), nullptr, nullptr);
+	return result;
+}
+
+// the message of GetLastError(), the counterpart of std::strerror(errno)
+std::string last_error() {
+	const auto error = ::GetLastError();
+	wchar_t *message = nullptr;
+	const auto length = ::FormatMessageW(FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS,
+		nullptr, error, 0, reinterpret_cast<wchar_t *>(&message), 0, nullptr);
+	if (!length) {
+		return "error " + std::to_string(error);
+	}
+	auto result = narrow({ message, length });
+	::LocalFree(message);
+	while (!result.empty() && (result.back() == '\n' || result.back() == '\r' || result.back() == '.')) {
+		result.pop_back();
+	}
+	return result;
+}
+
+// absolute path in the \\?\ form, which is not limited to MAX_PATH and skips the normalization of every call
+std::wstring native(const std::filesystem::path& path) {
+	auto result = std::filesystem::absolute(path).lexically_normal().wstring();
+	std::replace(result.begin(), result.end(), L'/', L'\\');
+	if (result.rfind(L"\\\\?\\", 0) == 0) {
+		return result;
+	}
+	if (result.rfind(L"\\\\", 0) == 0) {
+		return L"\\\\?\\UNC\\" + result.substr(2);
+	}
+	return L"\\\\?\\" + result;
+}
+
+// 100ns ticks since 1601 as nanoseconds, only ever compared with each other
+int64_t nanoseconds(const LARGE_INTEGER& time) {
+	return time.QuadPart * 100;
+}
+#endif
+
+// measures the scope it lives in
+class Timed {
+public:
+	explicit Timed(Histogram& histogram) : histogram(histogram) {}
+
+	~Timed() {
+		histogram.record(std::chrono::steady_clock::now() - start);
+	}
+
+	Timed(const Timed&) = delete;
+	Timed& operator=(const Timed&) = delete;
+
+private:
+	Histogram& histogram;
+	const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+};
+
+// records are sorted in memory and written to anonymous temporary files as sorted runs whenever the buffer outgrows
+// its budget, merge() then hands every record back in order through a k-way merge of the runs
+template <typename Record>
+class Spill {
+public:
+	explicit Spill(size_t budget) : budget(budget) {}
+
+	~Spill() {
+		for (auto *run : runs) {
+			std::fclose(run);
+		}
+	}
+
+	Spill(const Spill&) = delete;
+	Spill& operator=(const Spill&) = delete;
+
+	void add(Record record) {
+		std::lock_guard lock(mutex);
+		used += record.footprint();
+		records.push_back(std::move(record));
+		if (used > budget) {
+			spill();
+		}
+	}
+
+	template <typename Callback>
+	void merge(Callback&& callback) {
+		std::sort(records.begin(), records.end());
+		if (runs.empty()) {
+			for (auto & record : records) {
+				callback(std::move(record));
+			}
+			records = {};
+			return;
+		}
+
+		spill();
+
+		struct Head {
+			Record record;
+			size_t run;
+		};
+		const auto later = [](const Head& a, const Head& b) {
+			return b.record < a.record;
+		};
+
+		std::vector<Head> heads;
+		for (size_t i = 0; i < runs.size(); i++) {
+			std::rewind(runs[i]);
+			Record record;
+			if (record.read(runs[i])) {
+				heads.push_back({ std::move(record), i });
+			}
+		}
+		std::make_heap(heads.begin(), heads.end(), later);
+
+		while (!heads.empty()) {
+			std::pop_heap(heads.begin(), heads.end(), later);
+			auto head = std::move(heads.back());
+			heads.pop_back();
+
+			const auto run = head.run;
+			callback(std::move(head.record));
+
+			Record record;
+			if (record.read(runs[run])) {
+				heads.push_back({ std::move(record), run });
+				std::push_heap(heads.begin(), heads.end(), later);
+			}
+		}
+	}
+
+private:
+	void spill() {
+		std::sort(records.begin(), records.end());
+
+		std::FILE *run = std::tmpfile();
+		if (!run) {
+			std::ostringstream os;
+			os << "Cannot create spill file: " << std::strerror(errno) << ".";
+			throw std::runtime_error(os.str());
+		}
+		runs.push_back(run);
+
+		for (const auto & record : records) {
+			record.write(run);
+		}
+		if (0 != std::fflush(run) || std::ferror(run)) {
+			std::ostringstream os;
+			os << "Cannot write spill file: " << std::strerror(errno) << ".";
+			throw std::runtime_error(os.str());
+		}
+
+		records = {};
+		used = 0;
+	}
+
+	const size_t budget;
+	size_t used = 0;
+	std::mutex mutex;
+	std::vector<Record> records;
+	std::vector<std::FILE *> runs;
+};
+
+struct Candidate {
+	Path path;
+	uintmax_t size;
+	uint64_t device;
+	uint64_t inode;
+	int64_t mtime;
+	int64_t ctime;
+	uint64_t links;
+};
+
+#ifndef _WIN32
+int64_t nanoseconds(const struct timespec& time) {
+	return static_cast<int64_t>(time.tv_sec) * 1000000000 + time.tv_nsec;
+}
+
+Candidate candidate(const Path& path, const struct stat& st) {
+#ifdef __APPLE__
+	return { path, static_cast<uintmax_t>(st.st_size), static_cast<uint64_t>(st.st_dev), static_cast<uint64_t>(st.st_ino), nanoseconds(st.st_mtimespec), nanoseconds(st.st_ctimespec), static_cast<uint64_t>(st.st_nlink) };
+#else
+	return { path, static_cast<uintmax_t>(st.st_size), static_cast<uint64_t>(st.st_dev), static_cast<uint64_t>(st.st_ino), nanoseconds(st.st_mtim), nanoseconds(st.st_ctim), static_cast<uint64_t>(st.st_nlink) };
+#endif
+}
+#endif
+
+// files can only be linked within their filesystem, so sizes, samples and groups are all kept per device
+struct Size {
+	uint64_t device;
+	uintmax_t size;
+
+	bool operator==(const Size& other) const {
+		return device == other.device && size == other.size;
+	}
+
+	struct Hash {
+		size_t operator()(const Size& key) const {
+			return std::hash<uint64_t>()(key.size * 0x9e3779b97f4a7c15 ^ key.device);
+		}
+	};
+};
+
+// the first file seen of every size, reset once the size collides and the file is queued for hashing
+struct SizeShard {
+	std::mutex mutex;
+	std::unordered_map<Size, std::optional<Candidate>, Size::Hash> sizes;
+};
+
+struct Inode {
+	uint64_t device;
+	uint64_t inode;
+
+	bool operator==(const Inode& other) const {
+		return device == other.device && inode == other.inode;
+	}
+
+	struct Hash {
+		size_t operator()(const Inode& key) const {
+			return std::hash<uint64_t>()(key.inode * 0x9e3779b97f4a7c15 ^ key.device);
+		}
+	};
+};
+
+// every further path of an inode with several links, the inode itself is hashed and grouped only once
+struct InodeShard {
+	std::mutex mutex;
+	std::unordered_map<Inode, std::vector<Path>, Inode::Hash> aliases;
+};
+
+#ifndef _WIN32
+// directory descriptors recently used by one thread, a directory is opened relative to its nearest open ancestor
+// and files relative to their directory, so the kernel resolves every path component once instead of per file
+class Directories {
+public:
+	~Directories() {
+		clear();
+	}
+
+	// a thread may work for several sessions one after another, ids are only meaningful within the tree of one
+	void bind(const Paths& tree, uint64_t session) {
+		if (owner != session) {
+			clear();
+			paths = &tree;
+			owner = session;
+		}
+	}
+
+	void release(uint64_t session) {
+		if (owner == session) {
+			clear();
+			paths = nullptr;
+			owner = 0;
+		}
+	}
+
+	// the descriptor stays open until this thread needs room for other directories, the one returned last is never the one dropped
+	int get(uint32_t id) {
+		std::vector<uint32_t> chain;
+		int base = AT_FDCWD;
+		for (auto at = id; at != Paths::none; at = paths->parent(at)) {
+			if (const auto fd = find(at); fd >= 0) {
+				base = fd;
+				break;
+			}
+			chain.push_back(at);
+		}
+		if (chain.empty()) {
+			return base;
+		}
+
+		std::string relative;
+		for (auto it = chain.rbegin(); it != chain.rend(); ++it) {
+			if (!relative.empty()) {
+				relative += '/';
+			}
+			relative += paths->name(*it);
+		}
+
+		int fd = ::openat(base, relative.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (fd < 0 && (errno == EMFILE || errno == ENFILE) && shrink(base)) {
+			fd = ::openat(base, relative.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		}
+		if (fd < 0) {
+			std::ostringstream os;
+			os << "Cannot open directory \"" << paths->directory(id).string() << "\": " << std::strerror(errno) << ".";
+			throw std::runtime_error(os.str());
+		}
+
+		if (entries.size() == capacity) {
+			auto oldest = std::min_element(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) { return a.used < b.used; });
+			::close(oldest->fd);
+			*oldest = { id, fd, ++clock };
+		}
+		else {
+			entries.push_back({ id, fd, ++clock });
+		}
+		return fd;
+	}
+
+	// out of descriptors, everything but the ancestor in use and the descriptor returned last is given back
+	bool shrink(int base = -1) {
+		if (entries.empty()) {
+			return false;
+		}
+		const auto last = std::max_element(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) { return a.used < b.used; })->fd;
+		const auto kept = std::remove_if(entries.begin(), entries.end(), [&](const Entry& entry) {
+			if (entry.fd == base || entry.fd == last) {
+				return false;
+			}
+			::close(entry.fd);
+			return true;
+		});
+		const bool shrunk = kept != entries.end();
+		entries.erase(kept, entries.end());
+		return shrunk;
+	}
+
+private:
+	struct Entry {
+		uint32_t id;
+		int fd;
+		uint64_t used;
+	};
+
+	// per thread, a process running out of descriptors shrinks the caches back to what is in use
+	static constexpr size_t capacity = 16;
+
+	int find(uint32_t id) {
+		for (auto & entry : entries) {
+			if (entry.id == id) {
+				entry.used = ++clock;
+				return entry.fd;
+			}
+		}
+		return -1;
+	}
+
+	void clear() {
+		for (const auto & entry : entries) {
+			::close(entry.fd);
+		}
+		entries.clear();
+	}
+
+	const Paths *paths = nullptr;
+	uint64_t owner = 0;
+	std::vector<Entry> entries;
+	uint64_t clock = 0;
+};
+#endif
+
+// a shell pattern compiled once: '*' matches any run of characters, '/' included, '?' any single character,
+// [a-z] or [!a-z] one character of a set and a backslash escapes the next character; literals, prefixes,
+// suffixes and infixes, which most patterns are, skip the matcher for a plain comparison
+class Glob {
+public:
+	explicit Glob(const std::string& pattern) : whole_path(pattern.find('/') != std::string::npos) {
+		for (size_t i = 0; i < pattern.size(); i++) {
+			Token token;
+			if (pattern[i] == '*') {
+				if (!tokens.empty() && tokens.back().type == Token::star) {
+					continue;
+				}
+				token.type = Token::star;
+			}
+			else if (pattern[i] == '?') {
+				token.type = Token::any;
+			}
+			else if (pattern[i] == '[' && set(pattern, i, token)) {
+				token.type = Token::set;
+			}
+			else {
+				if (pattern[i] == '\\' && i + 1 < pattern.size()) {
+					i++;
+				}
+				token.type = Token::character;
+				token.value = pattern[i];
+			}
+			tokens.push_back(std::move(token));
+		}
+
+		// the characters between a leading and a trailing star decide the plain kinds
+		const bool leading = !tokens.empty() && tokens.front().type == Token::star;
+		const bool trailing = tokens.size() > leading && tokens.back().type == Token::star;
+		const auto plain = std::all_of(tokens.begin() + leading, tokens.end() - trailing, [](const Token& token) { return token.type == Token::character; });
+		if (plain) {
+			for (auto it = tokens.begin() + leading; it != tokens.end() - trailing; ++it) {
+				literal.push_back(it->value);
+			}
+			kind = leading && trailing ? Kind::infix : leading ? Kind::suffix : trailing ? Kind::prefix : Kind::literal;
+		}
+	}
+
+	bool match(std::string_view text) const {
+		switch (kind) {
+		case Kind::literal:
+			return text == literal;
+		case Kind::prefix:
+			return text.substr(0, literal.size()) == literal;
+		case Kind::suffix:
+			return text.size() >= literal.size() && text.substr(text.size() - literal.size()) == literal;
+		case Kind::infix:
+			return text.find(literal) != std::string_view::npos;
+		case Kind::general:
+			break;
+		}
+
+		// a star only ever needs to be retried from the last one seen, the tokens after it match nothing wider
+		size_t t = 0;
+		size_t p = 0;
+		size_t star = std::string::npos;
+		size_t mark = 0;
+		while (t < text.size()) {
+			if (p < tokens.size() && tokens[p].type == Token::star) {
+				star = p++;
+				mark = t;
+			}
+			else if (p < tokens.size() && tokens[p].matches(text[t])) {
+				p++;
+				t++;
+			}
+			else if (star != std::string::npos) {
+				p = star + 1;
+				t = ++mark;
+			}
+			else {
+				return false;
+			}
+		}
+		while (p < tokens.size() && tokens[p].type == Token::star) {
+			p++;
+		}
+		return p == tokens.size();
+	}
+
+	// a pattern with a slash is matched against the whole path, any other against the name alone
+	bool path() const {
+		return whole_path;
+	}
+
+private:
+	struct Token {
+		enum Type : uint8_t {
+			character,
+			any,
+			star,
+			set,
+		} type = character;
+		char value = 0;
+		bool negated = false;
+		std::vector<std::pair<unsigned char, unsigned char>> ranges;
+
+		bool matches(char c) const {
+			switch (type) {
+			case character:
+				return c == value;
+			case set: {
+				const auto u = static_cast<unsigned char>(c);
+				const bool found = std::any_of(ranges.begin(), ranges.end(), [u](const auto& range) { return range.first <= u && u <= range.second; });
+				return found != negated;
+			}
+			default:
+				return true;
+			}
+		}
+	};
+
+	// a bracket without its closing bracket is an ordinary character
+	static bool set(const std::string& pattern, size_t& i, Token& token) {
+		auto at = i + 1;
+		if (at < pattern.size() && (pattern[at] == '!' || pattern[at] == '^')) {
+			token.negated = true;
+			at++;
+		}
+		for (const auto first = at; at < pattern.size() && (pattern[at] != ']' || at == first); at++) {
+			const auto low = static_cast<unsigned char>(pattern[at]);
+			if (at + 2 < pattern.size() && pattern[at + 1] == '-' && pattern[at + 2] != ']') {
+				token.ranges.emplace_back(low, static_cast<unsigned char>(pattern[at + 2]));
+				at += 2;
+			}
+			else {
+				token.ranges.emplace_back(low, low);
+			}
+		}
+		if (at >= pattern.size()) {
+			token.negated = false;
+			token.ranges.clear();
+			return false;
+		}
+		i = at;
+		return true;
+	}
+
+	enum class Kind {
+		literal,
+		prefix,
+		suffix,
+		infix,
+		general,
+	};
+
+	std::vector<Token> tokens;
+	std::string literal;
+	Kind kind = Kind::general;
+	bool whole_path;
+};
+
+// the size bounds and the name patterns of the options, checked by the walkers before a file costs a stat where
+// its name already rules it out, and before a pruned directory is ever opened
+class Filter {
+public:
+	explicit Filter(const Paths& paths) : paths(paths) {}
+
+	void include(const std::string& pattern) {
+		includes.add(pattern);
+		describe('i', pattern);
+	}
+
+	void exclude(const std::string& pattern) {
+		excludes.add(pattern);
+		describe('e', pattern);
+	}
+
+	void prune(const std::string& pattern) {
+		prunes.add(pattern);
+		describe('p', pattern);
+	}
+
+	void sizes(uintmax_t min, uintmax_t max) {
+		if (min > max) {
+			throw std::invalid_argument("the minimum size is larger than the maximum size");
+		}
+		min_size = min;
+		max_size = max;
+	}
+
+	bool name(uint32_t directory, const char *name) const {
+		return (includes.empty() || includes.match(paths, directory, name)) && !excludes.match(paths, directory, name);
+	}
+
+	bool size(uintmax_t size) const {
+		return min_size <= size && size <= max_size;
+	}
+
+	bool directory(uint32_t parent, const char *name) const {
+		return !prunes.match(paths, parent, name);
+	}
+
+	// listings only hold what passed the filters, so they are only replayed under the same ones
+	uint64_t fingerprint() const {
+		uint64_t hash = 0xcbf29ce484222325;
+		const auto mix = [&hash](const void *data, size_t length) {
+			for (size_t i = 0; i < length; i++) {
+				hash = (hash ^ static_cast<const unsigned char *>(data)[i]) * 0x100000001b3;
+			}
+		};
+		mix(&min_size, sizeof(min_size));
+		mix(&max_size, sizeof(max_size));
+		mix(description.data(), description.size());
+		return hash;
+	}
+
+private:
+	class Patterns {
+	public:
+		void add(const std::string& pattern) {
+			globs.emplace_back(pattern);
+		}
+
+		bool empty() const {
+			return globs.empty();
+		}
+
+		// the whole path is only joined for the first pattern that needs it
+		bool match(const Paths& paths, uint32_t directory, const char *name) const {
+			std::string whole;
+			for (const auto & glob : globs) {
+				if (!glob.path()) {
+					if (glob.match(name)) {
+						return true;
+					}
+					continue;
+				}
+				if (whole.empty()) {
+					whole = (paths.directory(directory) / std::filesystem::u8path(name)).generic_u8string();
+				}
+				if (glob.match(whole)) {
+					return true;
+				}
+			}
+			return false;
+		}
+
+	private:
+		std::vector<Glob> globs;
+	};
+
+	void describe(char kind, const std::string& pattern) {
+		description.push_back(kind);
+		description.append(pattern).push_back('\0');
+	}
+
+	const Paths& paths;
+	Patterns includes;
+	Patterns excludes;
+	Patterns prunes;
+	uintmax_t min_size = 1;
+	uintmax_t max_size = UINTMAX_MAX;
+	std::string description;
+};
+
+// the listings of the previous run, stored next to the cache for incremental sessions: a directory whose own times are unchanged
+// has had no entry added, removed or renamed, so the names of its files and subdirectories are replayed from the listing instead
+// of read; a file edited in place leaves its directory alone, so the replayed files are still stated
+class Snapshot {
+public:
+	// the entries of one directory as they are listed, encoded right away
+	struct Listing {
+		void file(const Candidate& file, const char *name) {
+			const FileHeader header { file.size, file.device, file.inode, file.mtime, file.ctime, file.links, static_cast<uint32_t>(std::strlen(name)), 0 };
+			files.append(reinterpret_cast<const char *>(&header), sizeof(header)).append(name, header.length);
+			file_count++;
+		}
+
+		void directory(const char *name) {
+			const auto length = static_cast<uint32_t>(std::strlen(name));
+			directories.append(reinterpret_cast<const char *>(&length), sizeof(length)).append(name, length);
+			directory_count++;
+		}
+
+		std::string files;
+		std::string directories;
+		uint32_t file_count = 0;
+		uint32_t directory_count = 0;
+	};
+
+	bool enabled() const {
+		return !path.empty();
+	}
+
+	void load(const std::string& file, uint64_t fingerprint, const std::function<void(const std::string&)>& warning) {
+		path = file;
+		filters = fingerprint;
+
+		std::ifstream in(path, std::ifstream::binary);
+		if (not in.good()) {
+			return;
+		}
+		data.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+
+		Header header {};
+		if (data.size() < sizeof(header) || (std::memcpy(&header, data.data(), sizeof(header)), header.magic != magic || header.version != version)) {
+			warning("Ignoring incompatible snapshot \"" + path + "\".");
+			data.clear();
+			return;
+		}
+		if (header.filters != filters) {
+			warning("Ignoring snapshot \"" + path + "\", it was taken with other filters.");
+			data.clear();
+			return;
+		}
+
+		// only the directories are indexed, their entries are decoded when they are replayed; those are checked here
+		// already, a damaged snapshot is dropped as a whole and the tree is walked in full
+		for (size_t offset = sizeof(header); offset < data.size();) {
+			DirectoryHeader directory;
+			if (data.size() - offset < sizeof(directory)
+				|| (std::memcpy(&directory, data.data() + offset, sizeof(directory)),
+					data.size() - offset - sizeof(directory) < static_cast<uint64_t>(directory.path_length) + directory.body_length)
+				|| !valid(directory, data.data() + offset + sizeof(directory) + directory.path_length)) {
+				warning("Ignoring damaged snapshot \"" + path + "\".");
+				index.clear();
+				data.clear();
+				return;
+			}
+			index.emplace(std::string_view(data.data() + offset + sizeof(directory), directory.path_length), offset);
+			offset += sizeof(directory) + directory.path_length + directory.body_length;
+		}
+	}
+
+	// the names of the previous listing of a directory, as long as its times still match it
+	bool replay(const std::string& directory, int64_t mtime, int64_t ctime, const std::function<void(const char *)>& file,
+		const std::function<void(const char *)>& subdirectory) {
+		const auto it = index.find(directory);
+		if (it == index.end()) {
+			return false;
+		}
+
+		DirectoryHeader header;
+		std::memcpy(&header, data.data() + it->second, sizeof(header));
+		if (header.mtime != mtime || header.ctime != ctime) {
+			return false;
+		}
+
+		const char *at = data.data() + it->second + sizeof(header) + header.path_length;
+		std::string name;
+		for (uint32_t i = 0; i < header.files; i++) {
+			FileHeader entry;
+			std::memcpy(&entry, at, sizeof(entry));
+			name.assign(at + sizeof(entry), entry.length);
+			at += sizeof(entry) + entry.length;
+			file(name.c_str());
+		}
+		for (uint32_t i = 0; i < header.directories; i++) {
+			uint32_t length;
+			std::memcpy(&length, at, sizeof(length));
+			name.assign(at + sizeof(length), length);
+			at += sizeof(length) + length;
+			subdirectory(name.c_str());
+		}
+		return true;
+	}
+
+	// a directory changed within the last seconds may change again without its times moving, so it is listed again next run
+	void store(const std::string& directory, int64_t mtime, int64_t ctime, int64_t now, const Listing& listing) {
+		constexpr const int64_t settle = 2'000'000'000;
+		const bool settled = now - std::max(mtime, ctime) > settle;
+		const DirectoryHeader header { settled ? mtime : INT64_MIN, ctime, static_cast<uint32_t>(directory.size()),
+			static_cast<uint32_t>(listing.files.size() + listing.directories.size()), listing.file_count, listing.directory_count };
+
+		std::lock_guard lock(mutex);
+		written.append(reinterpret_cast<const char *>(&header), sizeof(header)).append(directory).append(listing.files).append(listing.directories);
+	}
+
+	// the listings of this run replace the previous ones atomically
+	void save() {
+		if (!enabled()) {
+			return;
+		}
+
+		const Header header { magic, version, filters };
+		const auto temporary = path + ".tmp";
+		std::ofstream file(temporary, std::ofstream::binary | std::ofstream::trunc);
+		file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+		file.write(written.data(), static_cast<std::streamsize>(written.size()));
+		file.close();
+
+		std::error_code error;
+		if (not file.good() || (std::filesystem::rename(temporary, path, error), error)) {
+			std::ostringstream os;
+			os << "Cannot write snapshot \"" << path << "\": " << (error ? error.message() : std::strerror(errno)) << ".";
+			throw std::runtime_error(os.str());
+		}
+	}
+
+private:
+	struct Header {
+		uint64_t magic;
+		uint64_t version;
+		uint64_t filters;
+	};
+
+	struct DirectoryHeader {
+		int64_t mtime;
+		int64_t ctime;
+		uint32_t path_length; // path bytes that follow, then the body
+		uint32_t body_length;
+		uint32_t files;
+		uint32_t directories;
+	};
+
+	struct FileHeader {
+		uint64_t size;
+		uint64_t device;
+		uint64_t inode;
+		int64_t mtime;
+		int64_t ctime;
+		uint64_t links;
+		uint32_t length; // name bytes that follow
+		uint32_t reserved;
+	};
+
+	// the entries fill the body exactly and every name is a single component, a replayed name is opened below the directory
+	static bool valid(const DirectoryHeader& directory, const char *body) {
+		const auto name = [](const char *at, uint32_t length) {
+			const std::string_view view(at, length);
+			return length && view != "." && view != ".." && view.find_first_of(std::string_view("/\0", 2)) == std::string_view::npos;
+		};
+
+		uint64_t left = directory.body_length;
+		const char *at = body;
+		for (uint32_t i = 0; i < directory.files; i++) {
+			FileHeader entry;
+			if (left < sizeof(entry) || (std::memcpy(&entry, at, sizeof(entry)), left - sizeof(entry) < entry.length) || !name(at + sizeof(entry), entry.length)) {
+				return false;
+			}
+			left -= sizeof(entry) + entry.length;
+			at += sizeof(entry) + entry.length;
+		}
+		for (uint32_t i = 0; i < directory.directories; i++) {
+			uint32_t length;
+			if (left < sizeof(length) || (std::memcpy(&length, at, sizeof(length)), left - sizeof(length) < length) || !name(at + sizeof(length), length)) {
+				return false;
+			}
+			left -= sizeof(length) + length;
+			at += sizeof(length) + length;
+		}
+		return left == 0;
+	}
+
+	static constexpr uint64_t magic = 0x3144535055445248; // "HRDUPSD1"
+	static constexpr uint64_t version = 2;
+
+	std::string path;
+	uint64_t filters = 0;
+	std::vector<char> data;
+	std::unordered_map<std::string_view, size_t> index;
+	std::mutex mutex;
+	std::string written;
+};
+
+constexpr const std::size_t block_size { 1 << 12 };
+
+// incremental digest of one file in the algorithm of the session
+class Digester {
+public:
+	virtual ~Digester() = default;
+	virtual void update(const void *data, size_t length) = 0;
+	virtual Digest final() = 0;
+};
+
+// through EVP so OpenSSL can pick its SHA-NI or ARMv8 implementation
+class Sha256 : public Digester {
+public:
+	Sha256() : ctx(EVP_MD_CTX_new()) {
+		if (!ctx || 1 != EVP_DigestInit_ex(ctx, EVP_sha256(), nullptr)) {
+			EVP_MD_CTX_free(ctx);
+			throw std::runtime_error("Cannot initialize SHA-256.");
+		}
+	}
+
+	~Sha256() override {
+		EVP_MD_CTX_free(ctx);
+	}
+
+	void update(const void *data, size_t length) override {
+		EVP_DigestUpdate(ctx, data, length);
+	}
+
+	Digest final() override {
+		Digest hash {};
+		unsigned int length;
+		EVP_DigestFinal_ex(ctx, hash.data(), &length);
+		return hash;
+	}
+
+private:
+	EVP_MD_CTX *ctx;
+};
+
+#ifdef HAVE_BLAKE3
+// the library dispatches to its SSE4.1, AVX2, AVX-512 or NEON kernels at run time
+class Blake3 : public Digester {
+public:
+	Blake3() {
+		blake3_hasher_init(&hasher);
+	}
+
+	void update(const void *data, size_t length) override {
+		blake3_hasher_update(&hasher, data, length);
+	}
+
+	Digest final() override {
+		Digest hash {};
+		blake3_hasher_finalize(&hasher, hash.data(), BLAKE3_OUT_LEN);
+		return hash;
+	}
+
+private:
+	blake3_hasher hasher;
+};
+#endif
+
+#ifdef HAVE_XXHASH
+// not cryptographic, 128 bits keep accidental collisions out of reach but pair it with verify for untrusted trees
+class Xxh3 : public Digester {
+public:
+	Xxh3() : state(XXH3_createState()) {
+		if (!state || XXH_OK != XXH3_128bits_reset(state)) {
+			XXH3_freeState(state);
+			throw std::runtime_error("Cannot initialize XXH3.");
+		}
+	}
+
+	~Xxh3() override {
+		XXH3_freeState(state);
+	}
+
+	void update(const void *data, size_t length) override {
+		XXH3_128bits_update(state, data, length);
+	}
+
+	Digest final() override {
+		XXH128_canonical_t canonical;
+		XXH128_canonicalFromHash(&canonical, XXH3_128bits_digest(state));
+
+		Digest hash {};
+		std::memcpy(hash.data(), canonical.digest, sizeof(canonical.digest));
+		return hash;
+	}
+
+private:
+	XXH3_state_t *state;
+};
+#endif
+
+std::unique_ptr<Digester> make_digester(Algorithm algorithm) {
+	switch (algorithm) {
+#ifdef HAVE_BLAKE3
+		case Algorithm::blake3:
+			return std::make_unique<Blake3>();
+#endif
+#ifdef HAVE_XXHASH
+		case Algorithm::xxh3:
+			return std::make_unique<Xxh3>();
+#endif
+		default:
+			return std::make_unique<Sha256>();
+	}
+}
+
+// content that is in memory as a whole, such as a small file, is hashed in one call without setting up a digester
+Digest hash_buffer(Algorithm algorithm, const void *data, size_t length) {
+	Digest hash {};
+	switch (algorithm) {
+#ifdef HAVE_BLAKE3
+		case Algorithm::blake3: {
+			blake3_hasher hasher;
+			blake3_hasher_init(&hasher);
+			blake3_hasher_update(&hasher, data, length);
+			blake3_hasher_finalize(&hasher, hash.data(), BLAKE3_OUT_LEN);
+			return hash;
+		}
+#endif
+#ifdef HAVE_XXHASH
+		case Algorithm::xxh3: {
+			XXH128_canonical_t canonical;
+			XXH128_canonicalFromHash(&canonical, XXH3_128bits(data, length));
+			std::memcpy(hash.data(), canonical.digest, sizeof(canonical.digest));
+			return hash;
+		}
+#endif
+		default: {
+			// every thread keeps one context, allocating it costs more than hashing a few KiB
+			thread_local const std::unique_ptr<EVP_MD_CTX, decltype(&EVP_MD_CTX_free)> ctx(EVP_MD_CTX_new(), &EVP_MD_CTX_free);
+			unsigned int size;
+			if (!ctx || 1 != EVP_DigestInit_ex(ctx.get(), EVP_sha256(), nullptr) || 1 != EVP_DigestUpdate(ctx.get(), data, length)
+				|| 1 != EVP_DigestFinal_ex(ctx.get(), hash.data(), &size)) {
+				throw std::runtime_error("Cannot compute SHA-256.");
+			}
+			return hash;
+		}
+	}
+}
+
+struct Key {
+	uint64_t device;
+	uint64_t size;
+	Digest digest;
+
+	bool operator==(const Key& other) const {
+		return device == other.device && size == other.size && digest == other.digest;
+	}
+};
+
+// open addressing with linear probing over a flat slot array, the slots index a dense vector of entries
+template <typename Value>
+class Table {
+public:
+	using Entry = std::pair<Key, Value>;
+
+	// returns the entry of the key and whether it was just inserted with a default value
+	std::pair<Value&, bool> emplace(const Key& key) {
+		if ((entries.size() + 1) * 2 > slots.size()) {
+			grow();
+		}
+
+		const size_t mask = slots.size() - 1;
+		for (size_t i = hash(key) & mask;; i = (i + 1) & mask) {
+			auto &slot = slots[i];
+			if (!slot) {
+				entries.emplace_back(key, Value());
+				slot = static_cast<uint32_t>(entries.size());
+				return { entries.back().second, true };
+			}
+			if (entries[slot - 1].first == key) {
+				return { entries[slot - 1].second, false };
+			}
+		}
+	}
+
+	typename std::vector<Entry>::const_iterator begin() const {
+		return entries.begin();
+	}
+
+	typename std::vector<Entry>::const_iterator end() const {
+		return entries.end();
+	}
+
+	void clear() {
+		entries = {};
+		slots = {};
+	}
+
+private:
+	// digests are uniform already, the mix only spreads digests shorter than the key, the size and the device into the low bits
+	static size_t hash(const Key& key) {
+		uint64_t h;
+		std::memcpy(&h, key.digest.data(), sizeof(h));
+		h ^= key.size * 0x9e3779b97f4a7c15 ^ key.device;
+		h ^= h >> 33;
+		h *= 0xff51afd7ed558ccd;
+		h ^= h >> 33;
+		return h;
+	}
+
+	void grow() {
+		std::vector<uint32_t> bigger(std::max<size_t>(slots.size() * 2, 16));
+		const size_t mask = bigger.size() - 1;
+		for (size_t index = 0; index < entries.size(); index++) {
+			size_t i = hash(entries[index].first) & mask;
+			while (bigger[i]) {
+				i = (i + 1) & mask;
+			}
+			bigger[i] = static_cast<uint32_t>(index + 1);
+		}
+		slots.swap(bigger);
+	}
+
+	std::vector<Entry> entries;
+	std::vector<uint32_t> slots; // zero is empty, otherwise the entry index plus one
+};
+
+// digests of previous runs, a sorted array of fixed size records memory-mapped straight from the cache file
+class Cache {
+public:
+	struct Record {
+		uint64_t device;
+		uint64_t inode;
+		uint64_t size;
+		int64_t mtime;
+		int64_t ctime;
+		uint32_t flags;
+		uint32_t reserved;
+		Digest sample;
+		Digest digest;
+
+		static constexpr uint32_t has_sample = 1;
+		static constexpr uint32_t has_digest = 2;
+
+		bool operator<(const Record& other) const {
+			return std::tie(device, inode) < std::tie(other.device, other.inode);
+		}
+	};
+
+	~Cache() {
+		unmap();
+	}
+
+	bool enabled() const {
+		return !path.empty();
+	}
+
+	void load(const std::string& file, Algorithm hash, const std::function<void(const std::string&)>& warning) {
+		path = file;
+		algorithm = hash;
+
+#ifdef _WIN32
+		// the file is closed right away, the view keeps the mapping alive and leaves the file free to be replaced on save
+		const auto handle = ::CreateFileW(native(path).c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (handle == INVALID_HANDLE_VALUE) {
+			if (::GetLastError() != ERROR_FILE_NOT_FOUND && ::GetLastError() != ERROR_PATH_NOT_FOUND) {
+				warning("Cannot open cache \"" + path + "\": " + last_error() + ".");
+			}
+			return;
+		}
+
+		LARGE_INTEGER size;
+		if (::GetFileSizeEx(handle, &size) && static_cast<uint64_t>(size.QuadPart) >= sizeof(Header)) {
+			if (const auto mapping = ::CreateFileMappingW(handle, nullptr, PAGE_READONLY, 0, 0, nullptr)) {
+				if (void *data = ::MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0)) {
+					mapped = data;
+					mapped_size = static_cast<size_t>(size.QuadPart);
+				}
+				::CloseHandle(mapping);
+			}
+		}
+		::CloseHandle(handle);
+#else
+		const int fd = ::open(path.c_str(), O_RDONLY);
+		if (fd < 0) {
+			if (errno != ENOENT) {
+				warning("Cannot open cache \"" + path + "\": " + std::strerror(errno) + ".");
+			}
+			return;
+		}
+
+		struct stat st;
+		if (0 == ::fstat(fd, &st) && static_cast<size_t>(st.st_size) >= sizeof(Header)) {
+			void *data = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (data != MAP_FAILED) {
+				mapped = data;
+				mapped_size = st.st_size;
+			}
+		}
+		::close(fd);
+#endif
+
+		const auto header = static_cast<const Header *>(mapped);
+		if (!header || header->magic != magic || header->version != version || header->record_size != sizeof(Record) || header->block_size != block_size
+			|| header->algorithm != static_cast<uint32_t>(algorithm)
+			|| header->count > (mapped_size - sizeof(Header)) / sizeof(Record)) {
+			warning("Ignoring incompatible cache \"" + path + "\".");
+			unmap();
+			return;
+		}
+
+		begin = reinterpret_cast<const Record *>(header + 1);
+		end = begin + header->count;
+	}
+
+	// a record is only valid for an inode that has not been touched since it was hashed, one settled from this run
+	// is as good as one from the file
+	const Record *find(const Candidate& candidate) const {
+		const auto *found = find(begin, end, candidate);
+		return found ? found : find(settled.data(), settled.data() + settled.size(), candidate);
+	}
+
+	// makes what this run stored so far searchable by find, for a run that hashes the same files a second way
+	void settle() {
+		std::lock_guard lock(mutex);
+		settled = records;
+		deduplicate(settled);
+	}
+
+	void store(const Candidate& candidate, const Digest& sample, const std::optional<Digest>& digest) {
+		if (!enabled()) {
+			return;
+		}
+
+		Record record {};
+		record.device = candidate.device;
+		record.inode = candidate.inode;
+		record.size = candidate.size;
+		record.mtime = candidate.mtime;
+		record.ctime = candidate.ctime;
+		record.flags = Record::has_sample;
+		record.sample = sample;
+		if (digest) {
+			record.flags |= Record::has_digest;
+			record.digest = *digest;
+		}
+
+		std::lock_guard lock(mutex);
+		records.push_back(record);
+	}
+
+	// the identity of an inode after this run changed its links, its record follows as long as size and mtime still match;
+	// a rewritten inode got the same content again through a clone and follows even though its mtime moved
+	void refresh(const Candidate& current, bool rewritten = false) {
+		if (!enabled()) {
+			return;
+		}
+
+		Record record {};
+		record.device = current.device;
+		record.inode = current.inode;
+		record.size = current.size;
+		record.mtime = current.mtime;
+		record.ctime = current.ctime;
+
+		std::lock_guard lock(mutex);
+		refreshed.emplace_back(record, rewritten);
+	}
+
+	// only inodes seen in this run are kept, the file is replaced atomically
+	void save() {
+		if (!enabled()) {
+			return;
+		}
+
+		deduplicate(records);
+
+		// links made concurrently leave their stats in any order, the latest ctime is the current one
+		for (const auto & [current, rewritten] : refreshed) {
+			const auto it = std::lower_bound(records.begin(), records.end(), current);
+			if (it != records.end() && it->device == current.device && it->inode == current.inode && it->size == current.size && (rewritten || it->mtime == current.mtime)) {
+				if (rewritten) {
+					it->mtime = current.mtime;
+				}
+				it->ctime = std::max(it->ctime, current.ctime);
+			}
+		}
+		refreshed.clear();
+
+		unmap();
+
+		const Header header { magic, version, sizeof(Record), block_size, static_cast<uint32_t>(algorithm), records.size() };
+		const auto temporary = path + ".tmp";
+		std::ofstream file(temporary, std::ofstream::binary | std::ofstream::trunc);
+		file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+		file.write(reinterpret_cast<const char *>(records.data()), static_cast<std::streamsize>(records.size() * sizeof(Record)));
+		file.close();
+
+#ifdef _WIN32
+		// rename() refuses to replace an existing file on Windows
+		if (not file.good() || !::MoveFileExW(native(temporary).c_str(), native(path).c_str(), MOVEFILE_REPLACE_EXISTING)) {
+			std::ostringstream os;
+			os << "Cannot write cache \"" << path << "\": " << (file.good() ? last_error() : std::strerror(errno)) << ".";
+			throw std::runtime_error(os.str());
+		}
+#else
+		if (not file.good() || 0 != std::rename(temporary.c_str(), path.c_str())) {
+			std::ostringstream os;
+			os << "Cannot write cache \"" << path << "\": " << std::strerror(errno) << ".";
+			throw std::runtime_error(os.str());
+		}
+#endif
+	}
+
+private:
+	struct Header {
+		uint64_t magic;
+		uint32_t version;
+		uint32_t record_size;
+		uint32_t block_size;
+		uint32_t algorithm;
+		uint64_t count;
+	};
+
+	static constexpr uint64_t magic = 0x3143535055445248; // "HRDUPSC1"
+	static constexpr uint32_t version = 2;
+
+	void unmap() {
+		if (mapped) {
+#ifdef _WIN32
+			::UnmapViewOfFile(mapped);
+#else
+			::munmap(mapped, mapped_size);
+#endif
+		}
+		mapped = nullptr;
+		mapped_size = 0;
+		begin = end = nullptr;
+	}
+
+	std::string path;
+	Algorithm algorithm = Algorithm::sha256;
+	void *mapped = nullptr;
+	size_t mapped_size = 0;
+	const Record *begin = nullptr;
+	const Record *end = nullptr;
+	std::mutex mutex;
+	std::vector<Record> records;
+	std::vector<Record> settled;
+	std::vector<std::pair<Record, bool>> refreshed;
+
+	// one record per inode, sorted for lower_bound, one with a digest wins over one with only a sample
+	static void deduplicate(std::vector<Record>& records) {
+		std::sort(records.begin(), records.end(), [](const Record& a, const Record& b) {
+			return std::tie(a.device, a.inode, b.flags) < std::tie(b.device, b.inode, a.flags);
+		});
+		records.erase(std::unique(records.begin(), records.end(), [](const Record& a, const Record& b) {
+			return a.device == b.device && a.inode == b.inode;
+		}), records.end());
+	}
+
+	static const Record *find(const Record *first, const Record *last, const Candidate& candidate) {
+		Record key {};
+		key.device = candidate.device;
+		key.inode = candidate.inode;
+
+		const auto it = std::lower_bound(first, last, key);
+		if (it == last || it->device != candidate.device || it->inode != candidate.inode) {
+			return nullptr;
+		}
+		if (it->size != candidate.size || it->mtime != candidate.mtime || it->ctime != candidate.ctime) {
+			return nullptr;
+		}
+		return it;
+	}
+};
+
+// token buckets for the bytes and the calls of every read of a session: a reader takes a call up front and pays for
+// the bytes it got afterwards, the next reader sleeps off any debt. With a latency target the limits are recomputed
+// every window from the 90th percentile of the read latencies: halved while it is above the target, raised by an
+// eighth while it is below and lifted once they no longer bind
+class Throttle {
+public:
+	explicit Throttle(const Histogram& latencies) : latencies(latencies) {}
+
+	void configure(uintmax_t rate, unsigned long iops, std::chrono::microseconds latency) {
+		byte_limit = byte_rate = static_cast<double>(rate);
+		call_limit = call_rate = static_cast<double>(iops);
+		target = latency;
+		bytes = byte_rate / 10;
+		calls = std::max(call_rate / 10, 1.0);
+		last = window = std::chrono::steady_clock::now();
+		seen = latencies.counts();
+		enabled = rate || iops || latency.count();
+	}
+
+	// before every read
+	void acquire() {
+		if (!enabled) {
+			return;
+		}
+
+		std::chrono::steady_clock::time_point until;
+		{
+			std::lock_guard lock(mutex);
+			const auto now = std::chrono::steady_clock::now();
+			refill(now);
+			if (target.count() && now - window >= period) {
+				adapt(now);
+			}
+			passed_calls++;
+
+			double debt = 0;
+			if (byte_rate > 0) {
+				debt = std::max(debt, -bytes / byte_rate);
+			}
+			if (call_rate > 0) {
+				calls -= 1;
+				debt = std::max(debt, -calls / call_rate);
+			}
+			if (debt <= 0) {
+				return;
+			}
+			until = now + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(debt));
+		}
+		std::this_thread::sleep_until(until);
+	}
+
+	// the bytes a read returned
+	void consume(size_t length) {
+		if (!enabled) {
+			return;
+		}
+		std::lock_guard lock(mutex);
+		passed_bytes += static_cast<double>(length);
+		if (byte_rate > 0) {
+			bytes -= static_cast<double>(length);
+		}
+	}
+
+private:
+	static constexpr std::chrono::milliseconds period { 250 };
+	static constexpr double min_byte_rate = 1 << 16;
+	static constexpr double min_call_rate = 16;
+
+	// a bucket holds a tenth of a second at most, so an idle reader cannot save up a burst
+	void refill(std::chrono::steady_clock::time_point now) {
+		const auto elapsed = std::chrono::duration<double>(now - last).count();
+		last = now;
+		if (byte_rate > 0) {
+			bytes = std::min(bytes + elapsed * byte_rate, byte_rate / 10);
+		}
+		if (call_rate > 0) {
+			calls = std::min(calls + elapsed * call_rate, std::max(call_rate / 10, 1.0));
+		}
+	}
+
+	void adapt(std::chrono::steady_clock::time_point now) {
+		const auto counts = latencies.counts();
+		std::array<uint64_t, 32> recent;
+		uint64_t total = 0;
+		for (size_t i = 0; i < counts.size(); i++) {
+			recent[i] = counts[i] - seen[i];
+			total += recent[i];
+		}
+		seen = counts;
+
+		const auto seconds = std::chrono::duration<double>(now - window).count();
+		const auto byte_pace = passed_bytes / seconds;
+		const auto call_pace = passed_calls / seconds;
+		window = now;
+		passed_bytes = passed_calls = 0;
+
+		// too few reads to tell anything
+		if (total < 8) {
+			return;
+		}
+
+		size_t bucket = 0;
+		for (uint64_t below = 0; bucket + 1 < recent.size() && (below += recent[bucket]) * 10 < total * 9; bucket++) {
+		}
+		const auto slow = std::chrono::microseconds(uint64_t(1) << bucket) > target;
+
+		const auto steer = [slow](double& rate, double limit, double pace, double floor) {
+			if (slow) {
+				rate = std::max((rate > 0 ? std::min(rate, pace) : pace) / 2, floor);
+			}
+			else if (rate > 0) {
+				rate *= 1.125;
+				if (limit > 0 ? rate >= limit : rate > 2 * pace) {
+					rate = limit;
+				}
+			}
+		};
+		steer(byte_rate, byte_limit, byte_pace, min_byte_rate);
+		steer(call_rate, call_limit, call_pace, min_call_rate);
+	}
+
+	const Histogram& latencies;
+	bool enabled = false;
+	double byte_limit = 0;
+	double call_limit = 0;
+	double byte_rate = 0;
+	double call_rate = 0;
+	double bytes = 0;
+	double calls = 0;
+	std::chrono::microseconds target { 0 };
+	std::chrono::steady_clock::time_point last;
+	std::chrono::steady_clock::time_point window;
+	std::array<uint64_t, 32> seen {};
+	double passed_bytes = 0;
+	double passed_calls = 0;
+	std::mutex mutex;
+};
+
+// every thread a session starts calls this first, the thread of the caller keeps its priority and hands the reads it
+// would make itself to one of them
+void lower_priority(const Options& options) {
+#if defined(_WIN32)
+	// the background mode lowers both the cpu and the io priority
+	if (options.idle_io) {
+		::SetThreadPriority(::GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN);
+	}
+	else if (options.nice > 0) {
+		::SetThreadPriority(::GetCurrentThread(), options.nice >= 10 ? THREAD_PRIORITY_LOWEST : THREAD_PRIORITY_BELOW_NORMAL);
+	}
+#elif defined(__linux__)
+	// both are per thread on Linux, a failure such as a negative nice without privileges leaves the priority alone
+	if (options.idle_io) {
+		constexpr int who_process = 1;
+		constexpr int class_idle = 3;
+		constexpr int class_shift = 13;
+		::syscall(SYS_ioprio_set, who_process, 0, class_idle << class_shift);
+	}
+	if (options.nice) {
+		const auto thread = static_cast<id_t>(::syscall(SYS_gettid));
+		errno = 0;
+		const auto current = ::getpriority(PRIO_PROCESS, thread);
+		if (errno == 0) {
+			::setpriority(PRIO_PROCESS, thread, std::clamp(current + options.nice, -20, 19));
+		}
+	}
+#elif defined(__APPLE__)
+	// a niceness is per process here, only the io policy can be set per thread
+	if (options.idle_io) {
+		::setiopolicy_np(IOPOL_TYPE_DISK, IOPOL_SCOPE_THREAD, IOPOL_THROTTLE);
+	}
+#else
+	(void)options;
+#endif
+}
+
+// the grouping reads every candidate again with verify, so with a lowered priority it runs on a thread of its own
+template <typename Work>
+void lowered(const Options& options, Work&& work) {
+	if (!options.idle_io && !options.nice) {
+		work();
+		return;
+	}
+
+	std::exception_ptr failure;
+	std::thread([&] {
+		lower_priority(options);
+		try {
+			work();
+		}
+		catch (...) {
+			failure = std::current_exception();
+		}
+	}).join();
+	if (failure) {
+		std::rethrow_exception(failure);
+	}
+}
+
+#ifndef _WIN32
+Directories& thread_directories() {
+	thread_local Directories cache;
+	return cache;
+}
+#endif
+
+}
+
+// everything the components of a session share with each other and with their threads
+struct Context {
+	Context(Options options, Callbacks callbacks) : options(std::move(options)), callbacks(std::move(callbacks)), filter(paths), names(paths.arena()) {
+		// only tells sessions apart, a new one may well be allocated where an old one was
+		static std::atomic<uint64_t> sessions { 0 };
+		serial = ++sessions;
+	}
+
+	~Context() {
+#ifndef _WIN32
+		thread_directories().release(serial);
+#endif
+	}
+
+	void error(const std::string& message) {
+		counters.errors.fetch_add(1, std::memory_order_relaxed);
+		if (callbacks.error) {
+			callbacks.error(message);
+		}
+	}
+
+	void error(const std::exception& e) {
+		error(std::string(e.what()));
+	}
+
+	void warning(const std::string& message) {
+		if (callbacks.warning) {
+			callbacks.warning(message);
+		}
+	}
+
+	void phase(const char *name) {
+		if (callbacks.phase) {
+			callbacks.phase(name);
+		}
+	}
+
+#ifndef _WIN32
+	Directories& directories() {
+		auto &cache = thread_directories();
+		cache.bind(paths, serial);
+		return cache;
+	}
+#endif
+
+	// a file named from outside a walk, its directory becomes a root of the tree once and is shared from then on
+	Path intern(const std::filesystem::path& path) {
+		const auto parent = path.has_parent_path() ? path.parent_path().u8string() : std::string(".");
+		std::lock_guard lock(mutex);
+		auto [it, inserted] = roots.try_emplace(parent, 0);
+		if (inserted) {
+			it->second = paths.add(Paths::none, names.intern(parent));
+		}
+		return { it->second, names.intern(path.filename().u8string()) };
+	}
+
+	Candidate candidate(const FileInfo& file) {
+		return { intern(file.path), file.size, file.device, file.inode, file.mtime, file.ctime, file.links };
+	}
+
+	// the path may be another link of the inode the identity was taken from
+	FileInfo info(const Path& path, const Candidate& identity) const {
+		return { paths.full(path), identity.size, identity.device, identity.inode, identity.mtime, identity.ctime, identity.links };
+	}
+
+	FileInfo info(const Candidate& file) const {
+		return info(file.path, file);
+	}
+
+	void save() {
+		cache.save();
+		snapshot.save();
+	}
+
+	Options options;
+	Callbacks callbacks;
+	Counters counters;
+	Throttle throttle { counters.read };
+	Paths paths;
+	Filter filter;
+	Cache cache;
+	Snapshot snapshot;
+	uint64_t serial;
+
+private:
+	std::mutex mutex;
+	Arena& names;
+	std::unordered_map<std::string, uint32_t> roots;
+};
+
+namespace {
+
+// the times of a directory itself, false when they cannot be read
+bool directory_times(Context& context, uint32_t id, int64_t& mtime, int64_t& ctime) {
+#ifdef _WIN32
+	const auto handle = ::CreateFileW(native(context.paths.directory(id)).c_str(), FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr,
+		OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, nullptr);
+	if (handle == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+	FILE_BASIC_INFO times;
+	const bool known = ::GetFileInformationByHandleEx(handle, FileBasicInfo, &times, sizeof(times));
+	::CloseHandle(handle);
+	mtime = nanoseconds(times.LastWriteTime);
+	ctime = nanoseconds(times.ChangeTime);
+	return known;
+#else
+	// stat through the parent, a directory that is replayed is never opened itself
+	struct stat st;
+	try {
+		const auto parent = context.paths.parent(id);
+		if (0 != (parent == Paths::none ? ::stat(context.paths.name(id), &st) : ::fstatat(context.directories().get(parent), context.paths.name(id), &st, 0))) {
+			return false;
+		}
+	}
+	catch (const std::exception &) {
+		return false;
+	}
+	const auto times = candidate({}, st);
+	mtime = times.mtime;
+	ctime = times.ctime;
+	return true;
+#endif
+}
+
+// wall clock in the unit and epoch of the file times
+int64_t clock_now() {
+#ifdef _WIN32
+	FILETIME now;
+	::GetSystemTimePreciseAsFileTime(&now);
+	LARGE_INTEGER ticks;
+	ticks.LowPart = now.dwLowDateTime;
+	ticks.HighPart = static_cast<LONG>(now.dwHighDateTime);
+	return nanoseconds(ticks);
+#else
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+#endif
+}
+
+// the device and inode of a directory, none when it cannot be read
+std::optional<Inode> directory_identity(const std::filesystem::path& path) {
+#ifdef _WIN32
+	const auto handle = ::CreateFileW(native(path).c_str(), FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr,
+		OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, nullptr);
+	if (handle == INVALID_HANDLE_VALUE) {
+		return std::nullopt;
+	}
+	BY_HANDLE_FILE_INFORMATION information;
+	const bool known = ::GetFileInformationByHandle(handle, &information);
+	::CloseHandle(handle);
+	if (!known) {
+		return std::nullopt;
+	}
+	return Inode { information.dwVolumeSerialNumber, (static_cast<uint64_t>(information.nFileIndexHigh) << 32) | information.nFileIndexLow };
+#else
+	struct stat st;
+	if (0 != ::stat(path.c_str(), &st)) {
+		return std::nullopt;
+	}
+	return Inode { static_cast<uint64_t>(st.st_dev), static_cast<uint64_t>(st.st_ino) };
+#endif
+}
+
+// a file reachable from two roots would be walked twice, so roots inside other roots are dropped; the directories
+// are compared by path and by inode, so a root reached again through a bind mount of a directory it is in is dropped
+// as well. A bind mount below a root that leads back into another root is not seen here, its files are walked twice
+// and only grouped once
+std::vector<std::filesystem::path> distinct(Context& context, std::vector<std::filesystem::path> roots) {
+	std::vector<std::filesystem::path> resolved;
+	std::vector<std::vector<std::optional<Inode>>> chains; // the root itself, then every directory above it
+	for (const auto & root : roots) {
+		std::error_code error;
+		resolved.push_back(std::filesystem::weakly_canonical(root, error));
+		if (error) {
+			resolved.back() = std::filesystem::absolute(root).lexically_normal();
+		}
+		auto &chain = chains.emplace_back();
+		for (auto path = resolved.back();; path = path.parent_path()) {
+			chain.push_back(directory_identity(path));
+			if (path == path.parent_path()) {
+				break;
+			}
+		}
+	}
+	const auto inside = [](const std::filesystem::path& path, const std::filesystem::path& root) {
+		const auto relative = path.lexically_relative(root);
+		return !relative.empty() && *relative.begin() != "..";
+	};
+	const auto below = [&chains](size_t i, size_t j) {
+		const auto &root = chains[j].front();
+		return root && std::find(chains[i].begin() + 1, chains[i].end(), root) != chains[i].end();
+	};
+	for (size_t i = roots.size(); i-- > 0;) {
+		for (size_t j = 0; j < roots.size(); j++) {
+			const bool same = resolved[i] == resolved[j] || (chains[i].front() && chains[i].front() == chains[j].front());
+			if (i != j && (same ? j < i : inside(resolved[i], resolved[j]) || below(i, j))) {
+				context.warning("Skipping \"" + roots[i].string() + "\", it is already walked as part of \"" + roots[j].string() + "\".");
+				roots.erase(roots.begin() + i);
+				resolved.erase(resolved.begin() + i);
+				chains.erase(chains.begin() + i);
+				break;
+			}
+		}
+	}
+	return roots;
+}
+
+// directories waiting to be listed, every walker owns a deque and steals from the others once its own runs dry
+class Walker {
+public:
+	// called from the walker threads for every non-empty regular file, the name of its path is left to the sink to intern
+	using Sink = std::function<void(const Candidate& file, const char *name, Arena& arena)>;
+
+	Walker(Context& context, Sink sink) : context(context), tasks(std::max<size_t>(context.options.walkers, 1)), sink(std::move(sink)) {}
+
+	void walk(const std::vector<std::filesystem::path>& roots) {
+		auto &names = context.paths.arena();
+		for (const auto & root : distinct(context, roots)) {
+			push(0, context.paths.add(Paths::none, names.intern(root.u8string())));
+		}
+
+		std::vector<std::thread> threads;
+		for (size_t i = 0; i < tasks.size(); i++) {
+			threads.emplace_back([this, i, &arena = context.paths.arena()] {
+				lower_priority(context.options);
+				run(i, arena);
+			});
+		}
+		for (auto & thread : threads) {
+			thread.join();
+		}
+	}
+
+private:
+	struct Tasks {
+		std::mutex mutex;
+		std::deque<uint32_t> directories;
+	};
+
+	void push(size_t self, uint32_t directory) {
+		pending++;
+		{
+			std::lock_guard lock(tasks[self].mutex);
+			tasks[self].directories.push_back(directory);
+		}
+		idle.notify_one();
+	}
+
+	// own tasks are taken depth first from the back, stolen ones from the front where the larger subtrees are
+	bool pop(size_t self, uint32_t& directory) {
+		for (size_t i = 0; i < tasks.size(); i++) {
+			auto &victim = tasks[(self + i) % tasks.size()];
+			std::lock_guard lock(victim.mutex);
+			if (victim.directories.empty()) {
+				continue;
+			}
+			if (i == 0) {
+				directory = victim.directories.back();
+				victim.directories.pop_back();
+			}
+			else {
+				directory = victim.directories.front();
+				victim.directories.pop_front();
+			}
+			return true;
+		}
+		return false;
+	}
+
+	void run(size_t self, Arena& arena) {
+		uint32_t directory;
+		while (pending) {
+			if (!pop(self, directory)) {
+				std::unique_lock lock(idle_mutex);
+				idle.wait_for(lock, std::chrono::milliseconds(1));
+				continue;
+			}
+
+			try {
+				visit(self, directory, arena);
+			}
+			catch (const std::exception & e) {
+				context.error(e);
+			}
+
+			// children are already counted, so pending drops to zero only when the whole tree is listed
+			if (0 == --pending) {
+				idle.notify_all();
+			}
+		}
+	}
+
+	// with a snapshot an unchanged directory costs a stat of itself and of each of its files instead of a listing, the
+	// listing is stored again with the current stats; a listing is only stored when nothing failed
+	void visit(size_t self, uint32_t directory, Arena& arena) {
+		int64_t mtime;
+		int64_t ctime;
+		if (!context.snapshot.enabled() || !directory_times(context, directory, mtime, ctime)) {
+			list(self, directory, arena, nullptr);
+			return;
+		}
+
+		const auto name = context.paths.directory(directory).string();
+		const auto now = clock_now();
+		Snapshot::Listing listing;
+		bool complete = true;
+		const auto replayed = context.snapshot.replay(name, mtime, ctime, [&](const char *entry) {
+			complete = restat(directory, entry, arena, listing) && complete;
+		}, [&](const char *entry) {
+			push(self, context.paths.add(directory, arena.intern(entry)));
+			listing.directory(entry);
+		});
+
+		if (replayed ? complete : list(self, directory, arena, &listing)) {
+			context.snapshot.store(name, mtime, ctime, now, listing);
+		}
+	}
+
+	// a regular file that passed the name filter is listed whatever its size, a replay states it again and it may have
+	// grown in place since; only the non-empty ones within the size bounds go to the sink
+	void found(const Candidate& file, const char *name, Arena& arena, Snapshot::Listing *listing) {
+		if (listing) {
+			listing->file(file, name);
+		}
+		if (!file.size) {
+			return;
+		}
+		if (!context.filter.size(file.size)) {
+			context.counters.filtered.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+
+		context.counters.files.fetch_add(1, std::memory_order_relaxed);
+		try {
+			sink(file, name, arena);
+		}
+		catch (const std::exception & e) {
+			context.error(e);
+		}
+	}
+
+	// a replayed file as it is now, stated through the cached descriptor of its directory; false when it cannot be
+	bool restat(uint32_t directory, const char *name, Arena& arena, Snapshot::Listing& listing) {
+#ifdef _WIN32
+		const auto path = context.paths.full({ directory, name });
+		const auto handle = ::CreateFileW(native(path).c_str(), FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr,
+			OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OPEN_REPARSE_POINT, nullptr);
+		BY_HANDLE_FILE_INFORMATION information;
+		FILE_BASIC_INFO times;
+		const bool known = handle != INVALID_HANDLE_VALUE && ::GetFileInformationByHandle(handle, &information)
+			&& ::GetFileInformationByHandleEx(handle, FileBasicInfo, &times, sizeof(times));
+		const auto error = last_error();
+		if (handle != INVALID_HANDLE_VALUE) {
+			::CloseHandle(handle);
+		}
+		if (!known) {
+			context.error("Cannot stat \"" + path.string() + "\": " + error + ".");
+			return false;
+		}
+		if (!(information.dwFileAttributes & (FILE_ATTRIBUTE_DIRECTORY | FILE_ATTRIBUTE_REPARSE_POINT))) {
+			found({ { directory, nullptr }, (static_cast<uintmax_t>(information.nFileSizeHigh) << 32) | information.nFileSizeLow, information.dwVolumeSerialNumber,
+				(static_cast<uint64_t>(information.nFileIndexHigh) << 32) | information.nFileIndexLow, nanoseconds(times.LastWriteTime),
+				nanoseconds(times.ChangeTime), information.nNumberOfLinks }, name, arena, &listing);
+		}
+		return true;
+#else
+		struct stat st;
+		if (0 != ::fstatat(context.directories().get(directory), name, &st, AT_SYMLINK_NOFOLLOW)) {
+			const auto error = errno;
+			context.error("Cannot stat \"" + context.paths.full({ directory, name }).string() + "\": " + std::strerror(error) + ".");
+			return false;
+		}
+		if (S_ISREG(st.st_mode)) {
+			found(candidate({ directory, nullptr }, st), name, arena, &listing);
+		}
+		return true;
+#endif
+	}
+
+#ifdef _WIN32
+	// one call returns a whole buffer of entries together with their file ids, sizes and times, so unlike FindFirstFileExW
+	// no file is ever opened to tell its links apart; the number of links is not listed, so every file counts as linked
+	bool list(size_t self, uint32_t directory, Arena& arena, Snapshot::Listing *listing) {
+		const auto path = context.paths.directory(directory);
+		const auto fail = [this, &path](const char *what) {
+			context.error(std::string(what) + " \"" + path.string() + "\": " + last_error() + ".");
+		};
+
+		const auto handle = ::CreateFileW(native(path).c_str(), FILE_LIST_DIRECTORY, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr,
+			OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, nullptr);
+		if (handle == INVALID_HANDLE_VALUE) {
+			fail("Cannot list");
+			return false;
+		}
+		const std::unique_ptr<void, decltype(&::CloseHandle)> closer(handle, &::CloseHandle);
+
+		// every file of the directory lives on the same volume
+		BY_HANDLE_FILE_INFORMATION volume;
+		if (!::GetFileInformationByHandle(handle, &volume)) {
+			fail("Cannot stat");
+			return false;
+		}
+
+		thread_local std::vector<unsigned char> buffer(1 << 16);
+		for (auto kind = FileIdBothDirectoryRestartInfo;; kind = FileIdBothDirectoryInfo) {
+			if (!::GetFileInformationByHandleEx(handle, kind, buffer.data(), static_cast<DWORD>(buffer.size()))) {
+				if (::GetLastError() != ERROR_NO_MORE_FILES) {
+					fail("Cannot list");
+					return false;
+				}
+				return true;
+			}
+
+			for (size_t offset = 0;;) {
+				const auto &entry = *reinterpret_cast<const FILE_ID_BOTH_DIR_INFO *>(buffer.data() + offset);
+				const std::wstring_view name(entry.FileName, entry.FileNameLength / sizeof(wchar_t));
+
+				// junctions and symlinks are skipped like symlinks elsewhere
+				if (name != L"." && name != L".." && !(entry.FileAttributes & FILE_ATTRIBUTE_REPARSE_POINT)) {
+					const auto utf8 = narrow(name);
+					if (entry.FileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+						if (context.filter.directory(directory, utf8.c_str())) {
+							push(self, context.paths.add(directory, arena.intern(utf8)));
+							if (listing) {
+								listing->directory(utf8.c_str());
+							}
+						}
+					}
+					else if (!context.filter.name(directory, utf8.c_str())) {
+						context.counters.filtered.fetch_add(1, std::memory_order_relaxed);
+					}
+					else {
+						found({ { directory, nullptr }, static_cast<uintmax_t>(entry.EndOfFile.QuadPart), volume.dwVolumeSerialNumber,
+							static_cast<uint64_t>(entry.FileId.QuadPart), nanoseconds(entry.LastWriteTime), nanoseconds(entry.ChangeTime), 2 }, utf8.c_str(), arena, listing);
+					}
+				}
+
+				if (!entry.NextEntryOffset) {
+					break;
+				}
+				offset += entry.NextEntryOffset;
+			}
+		}
+	}
+#else
+	// an entry that cannot be inspected is reported and skipped, the rest of the directory is still listed;
+	// the entry type comes from readdir, so only regular files and filesystems without d_type cost a stat
+	bool list(size_t self, uint32_t directory, Arena& arena, Snapshot::Listing *listing) {
+		const int fd = context.directories().get(directory);
+		const auto fail = [this, directory](const char *name, const char *what) {
+			const auto error = errno;
+			const auto path = name ? context.paths.directory(directory) / name : context.paths.directory(directory);
+			context.error(std::string(what) + " \"" + path.string() + "\": " + std::strerror(error) + ".");
+		};
+
+		// the cached descriptor is only ever used with *at() calls, so the listing may share its offset
+		const int handle = ::dup(fd);
+		const auto closedir = [](DIR *stream) { ::closedir(stream); };
+		std::unique_ptr<DIR, decltype(closedir)> stream(handle < 0 ? nullptr : ::fdopendir(handle), closedir);
+		if (!stream) {
+			fail(nullptr, "Cannot list");
+			if (handle >= 0) {
+				::close(handle);
+			}
+			return false;
+		}
+
+		bool complete = true;
+		while (true) {
+			errno = 0;
+			const auto *entry = ::readdir(stream.get());
+			if (!entry) {
+				if (errno) {
+					fail(nullptr, "Cannot list");
+					return false;
+				}
+				return complete;
+			}
+
+			const char *name = entry->d_name;
+			if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+				continue;
+			}
+
+			auto type = entry->d_type;
+			if (type == DT_REG && !context.filter.name(directory, name)) {
+				context.counters.filtered.fetch_add(1, std::memory_order_relaxed);
+				continue;
+			}
+
+			struct stat st;
+			if (type == DT_REG || type == DT_UNKNOWN) {
+				if (0 != ::fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW)) {
+					fail(name, "Cannot stat");
+					complete = false;
+					continue;
+				}
+				if (S_ISREG(st.st_mode) && type == DT_UNKNOWN && !context.filter.name(directory, name)) {
+					context.counters.filtered.fetch_add(1, std::memory_order_relaxed);
+					continue;
+				}
+				type = S_ISREG(st.st_mode) ? DT_REG : S_ISDIR(st.st_mode) ? DT_DIR : DT_UNKNOWN;
+			}
+
+			if (type == DT_DIR) {
+				if (context.filter.directory(directory, name)) {
+					push(self, context.paths.add(directory, arena.intern(name)));
+					if (listing) {
+						listing->directory(name);
+					}
+				}
+				continue;
+			}
+
+			// skip symlinks and special files
+			if (type == DT_REG) {
+				found(candidate({ directory, nullptr }, st), name, arena, listing);
+			}
+		}
+	}
+#endif
+
+	Context& context;
+	std::vector<Tasks> tasks;
+	std::atomic<size_t> pending { 0 };
+	std::mutex idle_mutex;
+	std::condition_variable idle;
+	const Sink sink;
+};
+
+constexpr const std::size_t read_buffer_size { 1 << 20 };
+
+// smaller files are cheaper to read than to map and unmap
+constexpr const uintmax_t mmap_threshold { 1 << 24 };
+
+// read-only descriptor closed on scope exit, opened relative to the directory of the file
+class File {
+public:
+#ifdef _WIN32
+	using Handle = HANDLE;
+	static inline const Handle invalid = INVALID_HANDLE_VALUE;
+#else
+	using Handle = int;
+	static constexpr Handle invalid = -1;
+#endif
+
+	File(Context& context, const Path& location) : context(context), location(location), fd(open(context, location)) {
+		if (fd == invalid) {
+			fail("Cannot open");
+		}
+	}
+
+	~File() {
+#ifdef _WIN32
+		::CloseHandle(fd);
+#else
+		::close(fd);
+#endif
+	}
+
+	File(const File&) = delete;
+	File& operator=(const File&) = delete;
+
+	// reads until the buffer is full or the file ends, returns the number of bytes read
+	size_t read(void *buffer, size_t length, uint64_t offset) const {
+		size_t done = 0;
+		while (done < length) {
+			const auto result = read_some(static_cast<char *>(buffer) + done, length - done, offset + done);
+			if (result == 0) {
+				break;
+			}
+			done += result;
+		}
+		return done;
+	}
+
+	// a single read, short once the file ends and zero at its end
+	size_t read_some(void *buffer, size_t length, uint64_t offset) const {
+		while (true) {
+			context.throttle.acquire();
+			const Timed timed(context.counters.read);
+#ifdef _WIN32
+			// an offset in the OVERLAPPED makes a synchronous ReadFile positional like pread
+			OVERLAPPED at {};
+			at.Offset = static_cast<DWORD>(offset);
+			at.OffsetHigh = static_cast<DWORD>(offset >> 32);
+			DWORD result = 0;
+			if (!::ReadFile(fd, buffer, static_cast<DWORD>(std::min<size_t>(length, 1 << 30)), &result, &at)) {
+				if (::GetLastError() == ERROR_HANDLE_EOF) {
+					return 0;
+				}
+				fail("Cannot read");
+			}
+#else
+			const auto result = ::pread(fd, buffer, length, static_cast<off_t>(offset));
+			if (result < 0 && errno == EINTR) {
+				continue;
+			}
+			if (result < 0) {
+				fail("Cannot read");
+			}
+#endif
+			context.throttle.consume(result);
+			return static_cast<size_t>(result);
+		}
+	}
+
+	// the length the file has now, the size it was listed with may be out of date
+	uintmax_t length() const {
+#ifdef _WIN32
+		LARGE_INTEGER size;
+		if (!::GetFileSizeEx(fd, &size)) {
+			fail("Cannot stat");
+		}
+		return static_cast<uintmax_t>(size.QuadPart);
+#else
+		struct stat st;
+		if (0 != ::fstat(fd, &st)) {
+			fail("Cannot stat");
+		}
+		return static_cast<uintmax_t>(st.st_size);
+#endif
+	}
+
+	[[noreturn]] void fail(const char *what) const {
+#ifdef _WIN32
+		fail(what, last_error());
+#else
+		fail(what, std::strerror(errno));
+#endif
+	}
+
+	[[noreturn]] void fail(const char *what, const std::string& reason) const {
+		std::ostringstream os;
+		os << what << " \"" << path().string() << "\": " << reason << ".";
+		throw std::runtime_error(os.str());
+	}
+
+	std::filesystem::path path() const {
+		return context.paths.full(location);
+	}
+
+	Context& context;
+	const Path location;
+	const Handle fd;
+
+private:
+	static Handle open(Context& context, const Path& location) {
+#ifdef _WIN32
+		const auto path = native(context.paths.full(location));
+		const Timed timed(context.counters.open);
+		return ::CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+#else
+		const int directory = context.directories().get(location.directory);
+		const Timed timed(context.counters.open);
+		const int fd = ::openat(directory, location.name, O_RDONLY | O_CLOEXEC);
+		if (fd < 0 && (errno == EMFILE || errno == ENFILE) && context.directories().shrink()) {
+			return ::openat(directory, location.name, O_RDONLY | O_CLOEXEC);
+		}
+		return fd;
+#endif
+	}
+};
+
+// where the content of a file starts on its device, nothing for files the filesystem cannot place, such as
+// those still waiting for delayed allocation, inline or on filesystems without an extent map
+std::optional<uint64_t> placement(Context& context, const Path& path) {
+	try {
+		const File file(context, path);
+#if defined(__linux__)
+		alignas(struct fiemap) unsigned char buffer[sizeof(struct fiemap) + sizeof(struct fiemap_extent)] {};
+		auto *map = reinterpret_cast<struct fiemap *>(buffer);
+		map->fm_length = FIEMAP_MAX_OFFSET;
+		map->fm_extent_count = 1;
+		if (0 == ::ioctl(file.fd, FS_IOC_FIEMAP, map) && map->fm_mapped_extents == 1
+			&& !(map->fm_extents[0].fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC | FIEMAP_EXTENT_DATA_INLINE))) {
+			return map->fm_extents[0].fe_physical;
+		}
+#elif defined(__APPLE__)
+		struct log2phys extent {};
+		if (-1 != ::fcntl(file.fd, F_LOG2PHYS, &extent)) {
+			return static_cast<uint64_t>(extent.l2p_devoffset);
+		}
+#elif defined(_WIN32)
+		// only the first run of clusters is wanted, the rest is reported as more data
+		STARTING_VCN_INPUT_BUFFER start {};
+		RETRIEVAL_POINTERS_BUFFER extents {};
+		DWORD returned = 0;
+		if ((::DeviceIoControl(file.fd, FSCTL_GET_RETRIEVAL_POINTERS, &start, sizeof(start), &extents, sizeof(extents), &returned, nullptr) || ::GetLastError() == ERROR_MORE_DATA)
+			&& extents.ExtentCount > 0 && extents.Extents[0].Lcn.QuadPart >= 0) {
+			return static_cast<uint64_t>(extents.Extents[0].Lcn.QuadPart);
+		}
+#endif
+	}
+	catch (const std::exception &) {
+		// hashing the file reports it
+	}
+	return std::nullopt;
+}
+
+// sorts the candidates per device, by inode or by placement with the files that cannot be placed last in inode order;
+// looking up the placements costs an open and an ioctl per file, so it is spread over the workers
+void arrange(Context& context, std::vector<Candidate>& candidates, unsigned long workers) {
+	if (context.options.order == Order::inode) {
+		std::sort(candidates.begin(), candidates.end(), [](const Candidate& a, const Candidate& b) {
+			return std::tie(a.device, a.inode) < std::tie(b.device, b.inode);
+		});
+		return;
+	}
+
+	std::vector<std::optional<uint64_t>> placements(candidates.size());
+	std::atomic<size_t> next { 0 };
+	std::vector<std::thread> threads;
+	for (unsigned long i = 0; i < std::max(workers, 1ul); i++) {
+		threads.emplace_back([&] {
+			lower_priority(context.options);
+			constexpr const size_t chunk = 256;
+			for (size_t first; (first = next.fetch_add(chunk)) < candidates.size();) {
+				for (auto j = first; j < std::min(first + chunk, candidates.size()); j++) {
+					placements[j] = placement(context, candidates[j].path);
+				}
+			}
+		});
+	}
+	for (auto & thread : threads) {
+		thread.join();
+	}
+
+	std::vector<size_t> sequence(candidates.size());
+	for (size_t i = 0; i < sequence.size(); i++) {
+		sequence[i] = i;
+	}
+	const auto rank = [&](size_t i) {
+		return std::make_tuple(candidates[i].device, !placements[i], placements[i].value_or(candidates[i].inode));
+	};
+	std::sort(sequence.begin(), sequence.end(), [&](size_t a, size_t b) { return rank(a) < rank(b); });
+
+	std::vector<Candidate> arranged;
+	arranged.reserve(candidates.size());
+	for (const auto i : sequence) {
+		arranged.push_back(std::move(candidates[i]));
+	}
+	candidates.swap(arranged);
+}
+
+// the first and the last block only, for files up to two blocks this is the digest of the whole content
+Digest sample(Context& context, const Path& path, uintmax_t size) {
+	const File file(context, path);
+
+	unsigned char buffer[2 * block_size + 1];
+	size_t length;
+
+	if (size <= 2 * block_size) {
+		// a small file takes one read of all of it, the byte asked for beyond its size tells whether it grew since the walk
+		const auto whole = static_cast<size_t>(size) + 1;
+		length = file.read_some(buffer, whole, 0);
+		if (length != 0 && length < size) {
+			length += file.read(buffer + length, whole - length, length);
+		}
+	}
+	else {
+		length = file.read(buffer, block_size, 0);
+		length += file.read(buffer + block_size, block_size, size - block_size);
+	}
+
+	// a failed read has thrown already, so a different length means the file grew or shrank since it was listed
+	if (length != std::min<uintmax_t>(size, 2 * block_size)) {
+		throw std::runtime_error("File \"" + file.path().string() + "\" changed since it was hashed.");
+	}
+
+	context.counters.hashed.fetch_add(length, std::memory_order_relaxed);
+	return hash_buffer(context.options.algorithm, buffer, length);
+}
+
+// every hashing thread reuses one page aligned buffer
+unsigned char *read_buffer() {
+#ifdef _WIN32
+	thread_local const std::unique_ptr<unsigned char, decltype(&::_aligned_free)> buffer(static_cast<unsigned char *>(::_aligned_malloc(read_buffer_size, 4096)), &::_aligned_free);
+#else
+	thread_local const std::unique_ptr<unsigned char, decltype(&std::free)> buffer(static_cast<unsigned char *>(std::aligned_alloc(4096, read_buffer_size)), &std::free);
+#endif
+	if (!buffer) {
+		throw std::bad_alloc();
+	}
+	return buffer.get();
+}
+
+// a mapping is hashed a buffer at a time, so its page faults are throttled like reads
+void update(Context& context, Digester& hasher, const void *data, uintmax_t size) {
+	for (uintmax_t offset = 0; offset < size; offset += read_buffer_size) {
+		const auto length = static_cast<size_t>(std::min<uintmax_t>(read_buffer_size, size - offset));
+		context.throttle.acquire();
+		context.throttle.consume(length);
+		hasher.update(static_cast<const unsigned char *>(data) + offset, length);
+		context.counters.hashed.fetch_add(length, std::memory_order_relaxed);
+	}
+}
+
+#ifndef _WIN32
+// a mapped file truncated while it is hashed raises SIGBUS on the pages past its end, the thread hashing it jumps
+// back out of the mapping instead, any other SIGBUS goes to the handler that was there before
+thread_local sigjmp_buf *mapping_fault = nullptr;
+struct sigaction previous_bus_handler {};
+
+void on_bus_error(int signal, siginfo_t *info, void *state) {
+	if (mapping_fault) {
+		siglongjmp(*mapping_fault, 1);
+	}
+
+	// chained, this handler stays installed for the faults of later mappings; a default or ignored action ends the process
+	if (previous_bus_handler.sa_flags & SA_SIGINFO) {
+		previous_bus_handler.sa_sigaction(signal, info, state);
+	}
+	else if (previous_bus_handler.sa_handler == SIG_DFL || previous_bus_handler.sa_handler == SIG_IGN) {
+		::signal(signal, SIG_DFL);
+		::raise(signal);
+	}
+	else {
+		previous_bus_handler.sa_handler(signal);
+	}
+}
+
+// false when the file was truncated under the mapping, the digest is of no use then
+bool update_mapping(Context& context, Digester& hasher, const void *data, uintmax_t size) {
+	static std::once_flag installed;
+	std::call_once(installed, [] {
+		struct sigaction action {};
+		action.sa_sigaction = on_bus_error;
+		action.sa_flags = SA_SIGINFO;
+		sigemptyset(&action.sa_mask);
+		::sigaction(SIGBUS, &action, &previous_bus_handler);
+	});
+
+	sigjmp_buf fault;
+	if (sigsetjmp(fault, 1) != 0) {
+		mapping_fault = nullptr;
+		return false;
+	}
+	mapping_fault = &fault;
+	update(context, hasher, data, size);
+	mapping_fault = nullptr;
+	return true;
+}
+#endif
+
+// a mapping only covers the file while it keeps the size it was listed with, a file that changed size is read instead,
+// so its digest is of the content it has now like with reads
+Digest digest(Context& context, const Path& path, uintmax_t size) {
+	const File file(context, path);
+
+	auto hasher = make_digester(context.options.algorithm);
+
+	if (context.options.io == Io::mmap && size >= mmap_threshold && file.length() == size) {
+#ifdef _WIN32
+		// a mapped file cannot be truncated on windows, only grown past the view
+		if (const auto mapping = ::CreateFileMappingW(file.fd, nullptr, PAGE_READONLY, 0, 0, nullptr)) {
+			const void *data = ::MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, static_cast<SIZE_T>(size));
+			::CloseHandle(mapping);
+			if (data) {
+				update(context, *hasher, data, size);
+				::UnmapViewOfFile(data);
+				if (file.length() == size) {
+					return hasher->final();
+				}
+				hasher = make_digester(context.options.algorithm);
+			}
+		}
+#else
+		void *data = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, file.fd, 0);
+		if (data != MAP_FAILED) {
+			::madvise(data, size, MADV_SEQUENTIAL);
+			const bool mapped = update_mapping(context, *hasher, data, size);
+			::munmap(data, size);
+			if (mapped && file.length() == size) {
+				return hasher->final();
+			}
+			hasher = make_digester(context.options.algorithm);
+		}
+#endif
+	}
+
+#ifndef _WIN32
+	::posix_fadvise(file.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+	auto *buffer = read_buffer();
+	uint64_t offset = 0;
+	while (const auto length = file.read(buffer, read_buffer_size, offset)) {
+		hasher->update(buffer, length);
+		context.counters.hashed.fetch_add(length, std::memory_order_relaxed);
+		offset += length;
+	}
+
+	return hasher->final();
+}
+
+#ifdef HAVE_URING
+// minimal io_uring submission and completion rings driven by raw syscalls, one ring per thread
+class Ring {
+public:
+	explicit Ring(unsigned entries) {
+		io_uring_params params {};
+		fd = static_cast<int>(::syscall(__NR_io_uring_setup, entries, &params));
+		if (fd < 0) {
+			std::ostringstream os;
+			os << "Cannot set up io_uring: " << std::strerror(errno) << ".";
+			throw std::runtime_error(os.str());
+		}
+
+		sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+		cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+		if (params.features & IORING_FEAT_SINGLE_MMAP) {
+			sq_size = cq_size = std::max(sq_size, cq_size);
+		}
+		sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+
+		sq = map(sq_size, IORING_OFF_SQ_RING);
+		cq = params.features & IORING_FEAT_SINGLE_MMAP ? sq : map(cq_size, IORING_OFF_CQ_RING);
+		sqes = static_cast<io_uring_sqe *>(map(sqes_size, IORING_OFF_SQES));
+
+		sq_tail = ring<unsigned>(sq, params.sq_off.tail);
+		sq_mask = *ring<unsigned>(sq, params.sq_off.ring_mask);
+		sq_array = ring<unsigned>(sq, params.sq_off.array);
+		cq_head = ring<unsigned>(cq, params.cq_off.head);
+		cq_tail = ring<unsigned>(cq, params.cq_off.tail);
+		cq_mask = *ring<unsigned>(cq, params.cq_off.ring_mask);
+		cqes = ring<io_uring_cqe>(cq, params.cq_off.cqes);
+	}
+
+	~Ring() {
+		if (sqes) {
+			::munmap(sqes, sqes_size);
+		}
+		if (cq && cq != sq) {
+			::munmap(cq, cq_size);
+		}
+		if (sq) {
+			::munmap(sq, sq_size);
+		}
+		::close(fd);
+	}
+
+	Ring(const Ring&) = delete;
+	Ring& operator=(const Ring&) = delete;
+
+	// whether the kernel knows an operation, setting up a ring works from 5.1 but IORING_OP_READ needs 5.6; the probe
+	// came with 5.6 as well, so a kernel that rejects it has no reads either
+	bool supports(unsigned opcode) const {
+		constexpr unsigned operations = 256;
+		std::vector<unsigned char> buffer(sizeof(io_uring_probe) + operations * sizeof(io_uring_probe_op));
+		auto *probe = reinterpret_cast<io_uring_probe *>(buffer.data());
+		if (::syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, operations) < 0) {
+			return false;
+		}
+		return opcode <= probe->last_op && (probe->ops[opcode].flags & IO_URING_OP_SUPPORTED);
+	}
+
+	// queues a read, the caller never has more reads outstanding than ring entries
+	void read(int file, void *buffer, unsigned length, uint64_t offset, uint64_t tag) {
+		const auto tail = *sq_tail;
+		const auto index = tail & sq_mask;
+		auto &sqe = sqes[index];
+		std::memset(&sqe, 0, sizeof(sqe));
+		sqe.opcode = IORING_OP_READ;
+		sqe.fd = file;
+		sqe.addr = reinterpret_cast<uint64_t>(buffer);
+		sqe.len = length;
+		sqe.off = offset;
+		sqe.user_data = tag;
+		sq_array[index] = index;
+		__atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+		queued++;
+	}
+
+	// submits the queued reads, waits for at least one completion and hands every completion to the callback
+	template <typename Callback>
+	void wait(Callback&& callback) {
+		while (::syscall(__NR_io_uring_enter, fd, queued, 1, IORING_ENTER_GETEVENTS, nullptr, 0) < 0) {
+			if (errno != EINTR) {
+				std::ostringstream os;
+				os << "Cannot wait for io_uring: " << std::strerror(errno) << ".";
+				throw std::runtime_error(os.str());
+			}
+		}
+		queued = 0;
+
+		auto head = *cq_head;
+		while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+			const auto cqe = cqes[head & cq_mask];
+			__atomic_store_n(cq_head, ++head, __ATOMIC_RELEASE);
+			callback(cqe.user_data, cqe.res);
+		}
+	}
+
+private:
+	void *map(size_t size, off_t offset) const {
+		void *data = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+		if (data == MAP_FAILED) {
+			std::ostringstream os;
+			os << "Cannot map io_uring: " << std::strerror(errno) << ".";
+			throw std::runtime_error(os.str());
+		}
+		return data;
+	}
+
+	template <typename T>
+	static T *ring(void *base, unsigned offset) {
+		return reinterpret_cast<T *>(static_cast<char *>(base) + offset);
+	}
+
+	int fd;
+	void *sq = nullptr;
+	void *cq = nullptr;
+	io_uring_sqe *sqes = nullptr;
+	size_t sq_size = 0;
+	size_t cq_size = 0;
+	size_t sqes_size = 0;
+	unsigned *sq_tail;
+	unsigned sq_mask;
+	unsigned *sq_array;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned cq_mask;
+	io_uring_cqe *cqes;
+	unsigned queued = 0;
+};
+#endif
+
+constexpr const std::size_t verify_block_size { 1 << 16 };
+constexpr const std::size_t verify_batch { 256 };
+
+// byte for byte check of files with equal digests before anything is destroyed: a batch of files is read block by block
+// in one pass, the files are split whenever their blocks differ and a file leaves as soon as no other one matches it
+std::vector<std::vector<const Candidate *>> verify_contents(Context& context, const std::vector<const Candidate *>& members, uintmax_t size) {
+	std::vector<std::vector<const Candidate *>> result;
+
+	for (size_t begin = 1; begin < members.size(); begin += verify_batch - 1) {
+		// every batch starts with the base, so the files identical to it still end up in a single subgroup
+		std::vector<const Candidate *> batch { members.front() };
+		batch.insert(batch.end(), members.begin() + begin, members.begin() + std::min(members.size(), begin + verify_batch - 1));
+
+		std::vector<std::unique_ptr<File>> files(batch.size());
+		std::vector<std::vector<size_t>> classes(1);
+		for (size_t i = 0; i < batch.size(); i++) {
+			try {
+				files[i] = std::make_unique<File>(context, batch[i]->path);
+				classes.front().push_back(i);
+			}
+			catch (const std::exception & e) {
+				context.error(e);
+			}
+		}
+
+		std::vector<unsigned char> buffers(batch.size() * verify_block_size);
+		const auto block = [&buffers](size_t i) {
+			return buffers.data() + i * verify_block_size;
+		};
+
+		for (uintmax_t offset = 0; offset < size && !classes.empty(); offset += verify_block_size) {
+			const auto length = static_cast<size_t>(std::min<uintmax_t>(verify_block_size, size - offset));
+
+			std::vector<std::vector<size_t>> next;
+			for (const auto & members_class : classes) {
+				std::vector<std::vector<size_t>> parts;
+				for (const auto i : members_class) {
+					try {
+						if (files[i]->read(block(i), length, offset) != length) {
+							context.error("File \"" + files[i]->path().string() + "\" changed since it was hashed.");
+							continue;
+						}
+					}
+					catch (const std::exception & e) {
+						context.error(e);
+						continue;
+					}
+
+					const auto part = std::find_if(parts.begin(), parts.end(), [&](const std::vector<size_t>& part) {
+						return 0 == std::memcmp(block(part.front()), block(i), length);
+					});
+					if (part == parts.end()) {
+						parts.push_back({ i });
+					}
+					else {
+						part->push_back(i);
+					}
+				}
+
+				for (auto & part : parts) {
+					if (part.size() < 2) {
+						files[part.front()].reset();
+						continue;
+					}
+					next.push_back(std::move(part));
+				}
+			}
+			classes.swap(next);
+		}
+
+		// equal up to the size is not enough, a file that grew since it was hashed has more than the others
+		for (const auto & members_class : classes) {
+			std::vector<const Candidate *> subgroup;
+			for (const auto i : members_class) {
+				try {
+					unsigned char beyond;
+					if (files[i]->read_some(&beyond, 1, size) != 0) {
+						context.error("File \"" + files[i]->path().string() + "\" changed since it was hashed.");
+						continue;
+					}
+				}
+				catch (const std::exception & e) {
+					context.error(e);
+					continue;
+				}
+				subgroup.push_back(batch[i]);
+			}
+			if (subgroup.size() > 1) {
+				result.push_back(std::move(subgroup));
+			}
+		}
+	}
+
+	return result;
+}
+
+// members of a group are chained through the member vector of the shard in insertion order,
+// a zero next ends the chain since the first member of a shard is never anyone's successor
+struct Chain {
+	uint32_t first = 0;
+	uint32_t last = 0;
+	uint32_t count = 0;
+};
+
+struct Member {
+	Candidate candidate;
+	uint32_t next;
+};
+
+// hashed files, sharded by the first digest byte so workers rarely wait for each other
+struct Shard {
+	std::mutex mutex;
+	Table<Chain> table;
+	std::vector<Member> members;
+};
+
+// a hashed file on its way through the external sort, the path stays an id into the in-memory directory tree
+struct GroupRecord {
+	Key key;
+	Candidate candidate;
+
+	bool operator<(const GroupRecord& other) const {
+		return std::tie(key.size, key.device, key.digest, candidate.inode) < std::tie(other.key.size, other.key.device, other.key.digest, other.candidate.inode);
+	}
+
+	size_t footprint() const {
+		return sizeof(*this);
+	}
+
+	// the run files never outlive the process, so the name pointer can be written as it is
+	void write(std::FILE *file) const {
+		std::fwrite(this, sizeof(*this), 1, file);
+	}
+
+	bool read(std::FILE *file) {
+		return 1 == std::fread(this, sizeof(*this), 1, file);
+	}
+};
+
+// what a member costs in the index: the member itself, its table entry and the slots at the worst load factor
+constexpr const std::size_t member_footprint { sizeof(Member) + sizeof(Table<Chain>::Entry) + 4 * sizeof(uint32_t) };
+
+// an entry of the size, sample and alias tables with the node and bucket of a hash map around it
+constexpr const std::size_t size_footprint { sizeof(std::pair<const Size, std::optional<Candidate>>) + 3 * sizeof(void *) };
+constexpr const std::size_t sample_footprint { sizeof(Table<std::optional<Candidate>>::Entry) + 4 * sizeof(uint32_t) };
+constexpr const std::size_t alias_footprint { sizeof(std::pair<const Inode, std::vector<Path>>) + 3 * sizeof(void *) };
+
+// a candidate whose full digest is computed by an io_uring thread
+struct Pending {
+	Candidate candidate;
+	Digest sample;
+};
+
+#ifdef HAVE_URING
+constexpr const unsigned uring_depth { 32 };
+constexpr const std::size_t uring_buffer_size { 1 << 18 };
+#endif
+
+// a group as the callbacks see it, files holds every path of each duplicate inode that is replaced by the base
+Group publish(const Context& context, const Key& key, const std::vector<const Candidate *>& subgroup, const std::vector<std::vector<Path>>& files) {
+	Group group { key.device, key.size, key.digest, context.info(*subgroup.front()), {} };
+	for (size_t i = 0; i < files.size(); i++) {
+		for (const auto & path : files[i]) {
+			group.duplicates.push_back(context.info(path, *subgroup[i + 1]));
+		}
+	}
+	return group;
+}
+
+// a path to be replaced by a hardlink to the base of its group, plans being applied also carry
+// the inodes both files were hashed as so they can be revalidated right before the link
+struct Link {
+	Path base;
+	Path target;
+	uintmax_t saved;
+	bool check = false;
+	Candidate expected_base {};
+	Candidate expected_target {};
+};
+
+// the target name never goes missing: the link is made under a temporary name in the target directory
+// and renamed over the target, so a failure at any point leaves either the old or the new file in place
+void relink(Context& context, const Path& base, uint32_t directory, const char *name) {
+	static std::atomic<unsigned long> counter { 0 };
+
+#ifdef _WIN32
+	// MoveFileExW replaces through a single rename of the directory entry, NTFS never shows the target missing
+	const auto target = context.paths.directory(directory) / std::filesystem::u8path(name);
+	const auto temporary = native(context.paths.directory(directory) / (".hrdups-" + std::to_string(::GetCurrentProcessId()) + "-" + std::to_string(counter++)));
+
+	if (!::CreateHardLinkW(temporary.c_str(), native(context.paths.full(base)).c_str(), nullptr)) {
+		std::ostringstream os;
+		os << "Cannot create hardlink for \"" << context.paths.full(base).string() << "\" as \"" << target.string() << "\": " << last_error() << ".";
+		throw std::runtime_error(os.str());
+	}
+
+	if (!::MoveFileExW(temporary.c_str(), native(target).c_str(), MOVEFILE_REPLACE_EXISTING)) {
+		std::ostringstream os;
+		os << "Cannot replace \"" << target.string() << "\": " << last_error() << ".";
+		::DeleteFileW(temporary.c_str());
+		throw std::runtime_error(os.str());
+	}
+#else
+	const int from = context.directories().get(base.directory);
+	const int to = context.directories().get(directory);
+	const auto temporary = ".hrdups-" + std::to_string(::getpid()) + "-" + std::to_string(counter++);
+
+	if (0 != ::linkat(from, base.name, to, temporary.c_str(), 0)) {
+		std::ostringstream os;
+		os << "Cannot create hardlink for \"" << context.paths.full(base).string() << "\" as \"" << (context.paths.directory(directory) / name).string() << "\": " << std::strerror(errno) << ".";
+		throw std::runtime_error(os.str());
+	}
+
+	if (0 != ::renameat(to, temporary.c_str(), to, name)) {
+		std::ostringstream os;
+		os << "Cannot replace \"" << (context.paths.directory(directory) / name).string() << "\": " << std::strerror(errno) << ".";
+		::unlinkat(to, temporary.c_str(), 0);
+		throw std::runtime_error(os.str());
+	}
+#endif
+}
+
+[[noreturn]] void fail_clone(Context& context, const Path& base, uint32_t directory, const char *name, const std::string& reason) {
+	std::ostringstream os;
+	os << "Cannot clone \"" << context.paths.full(base).string() << "\" to \"" << (context.paths.directory(directory) / name).string() << "\": " << reason << ".";
+	throw std::runtime_error(os.str());
+}
+
+[[noreturn]] void fail_clone(Context& context, const Path& base, uint32_t directory, const char *name) {
+	fail_clone(context, base, directory, name, std::strerror(errno));
+}
+
+#ifdef __linux__
+// every extent of the target is shared and lies where the same range of the base does, so a clone or dedupe of the
+// two was already made and doing it again would only map the same blocks once more
+bool shares_extents(int base, int target) {
+	const auto extents = [](int fd, std::vector<struct fiemap_extent>& found) {
+		constexpr const unsigned batch = 64;
+		alignas(struct fiemap) unsigned char buffer[sizeof(struct fiemap) + batch * sizeof(struct fiemap_extent)];
+		auto *map = reinterpret_cast<struct fiemap *>(buffer);
+		for (uint64_t start = 0;;) {
+			std::memset(buffer, 0, sizeof(buffer));
+			map->fm_start = start;
+			map->fm_length = FIEMAP_MAX_OFFSET - start;
+			map->fm_extent_count = batch;
+			if (0 != ::ioctl(fd, FS_IOC_FIEMAP, map)) {
+				return false;
+			}
+			if (!map->fm_mapped_extents) {
+				return true;
+			}
+			for (unsigned i = 0; i < map->fm_mapped_extents; i++) {
+				found.push_back(map->fm_extents[i]);
+				if (map->fm_extents[i].fe_flags & FIEMAP_EXTENT_LAST) {
+					return true;
+				}
+			}
+			const auto &last = map->fm_extents[map->fm_mapped_extents - 1];
+			start = last.fe_logical + last.fe_length;
+		}
+	};
+
+	std::vector<struct fiemap_extent> from;
+	std::vector<struct fiemap_extent> to;
+	if (!extents(base, from) || !extents(target, to) || to.empty() || from.size() != to.size()) {
+		return false;
+	}
+	for (size_t i = 0; i < to.size(); i++) {
+		if (!(to[i].fe_flags & FIEMAP_EXTENT_SHARED) || (to[i].fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC | FIEMAP_EXTENT_DATA_INLINE))
+			|| to[i].fe_logical != from[i].fe_logical || to[i].fe_physical != from[i].fe_physical || to[i].fe_length != from[i].fe_length) {
+			return false;
+		}
+	}
+	return true;
+}
+#endif
+
+// the target keeps its own inode, so later in-place writes to either file stay private to it; false when it already
+// shares the extents of the base
+bool reflink(Context& context, const Path& base, uint32_t directory, const char *name) {
+#if defined(__linux__)
+	// FICLONE swaps the whole content of the target for shared extents, owner and permissions stay as they are; that
+	// needs the target open for writing, another link of it would keep the old content if it were replaced instead
+	const File source(context, base);
+	const int fd = ::openat(context.directories().get(directory), name, O_WRONLY | O_CLOEXEC);
+	if (fd < 0) {
+		if (errno == EACCES || errno == EPERM) {
+			fail_clone(context, base, directory, name, "it cannot be opened for writing, only --mode=hardlink replaces read-only files");
+		}
+		fail_clone(context, base, directory, name);
+	}
+	const bool shared = shares_extents(source.fd, fd);
+	if (!shared && 0 != ::ioctl(fd, FICLONE, source.fd)) {
+		const auto error = errno;
+		::close(fd);
+		errno = error;
+		fail_clone(context, base, directory, name);
+	}
+	::close(fd);
+	return !shared;
+#elif defined(__APPLE__)
+	// clonefile only creates new files, so the clone takes over the owner and mode of the target and is renamed over it
+	static std::atomic<unsigned long> counter { 0 };
+	const int from = context.directories().get(base.directory);
+	const int to = context.directories().get(directory);
+	const auto temporary = ".hrdups-" + std::to_string(::getpid()) + "-" + std::to_string(counter++);
+
+	struct stat st;
+	if (0 != ::fstatat(to, name, &st, 0) || 0 != ::clonefileat(from, base.name, to, temporary.c_str(), 0)) {
+		fail_clone(context, base, directory, name);
+	}
+	::fchownat(to, temporary.c_str(), st.st_uid, st.st_gid, AT_SYMLINK_NOFOLLOW);
+	::fchmodat(to, temporary.c_str(), st.st_mode & 07777, 0);
+	if (0 != ::renameat(to, temporary.c_str(), to, name)) {
+		const auto error = errno;
+		::unlinkat(to, temporary.c_str(), 0);
+		errno = error;
+		fail_clone(context, base, directory, name);
+	}
+	return true;
+#else
+	errno = ENOTSUP;
+	fail_clone(context, base, directory, name);
+#endif
+}
+
+#ifdef __linux__
+// the kernel compares both ranges itself and shares the extents only where they are identical; false when they
+// already are shared, the kernel would read both files in full just to find that out
+bool dedupe_range(Context& context, const Path& base, uint32_t directory, const char *name) {
+	const File source(context, base);
+
+	// unprivileged owners may dedupe into files they can only read
+	const int parent = context.directories().get(directory);
+	int fd = ::openat(parent, name, O_RDWR | O_CLOEXEC);
+	if (fd < 0) {
+		fd = ::openat(parent, name, O_RDONLY | O_CLOEXEC);
+	}
+	if (fd < 0) {
+		fail_clone(context, base, directory, name);
+	}
+	if (shares_extents(source.fd, fd)) {
+		::close(fd);
+		return false;
+	}
+
+	struct stat st;
+	if (0 != ::fstat(source.fd, &st)) {
+		const auto error = errno;
+		::close(fd);
+		errno = error;
+		fail_clone(context, base, directory, name);
+	}
+
+	// filesystems cap a single request, so the file is deduplicated in slices
+	constexpr const uint64_t slice { 1 << 24 };
+	std::vector<unsigned char> storage(sizeof(file_dedupe_range) + sizeof(file_dedupe_range_info));
+	auto *range = reinterpret_cast<file_dedupe_range *>(storage.data());
+	auto &info = range->info[0];
+
+	for (uint64_t offset = 0; offset < static_cast<uint64_t>(st.st_size);) {
+		std::fill(storage.begin(), storage.end(), 0);
+		range->src_offset = offset;
+		range->src_length = std::min<uint64_t>(slice, st.st_size - offset);
+		range->dest_count = 1;
+		info.dest_fd = fd;
+		info.dest_offset = offset;
+
+		const bool failed = 0 != ::ioctl(source.fd, FIDEDUPERANGE, range);
+		if (failed || info.status < 0 || info.status == FILE_DEDUPE_RANGE_DIFFERS || !info.bytes_deduped) {
+			const auto error = failed ? errno : info.status < 0 ? -info.status : EIO;
+			::close(fd);
+			if (!failed && info.status == FILE_DEDUPE_RANGE_DIFFERS) {
+				std::ostringstream os;
+				os << "Not deduplicating \"" << (context.paths.directory(directory) / name).string() << "\": its content differs from \"" << context.paths.full(base).string() << "\".";
+				throw std::runtime_error(os.str());
+			}
+			errno = error;
+			fail_clone(context, base, directory, name);
+		}
+		offset += info.bytes_deduped;
+	}
+	::close(fd);
+	return true;
+}
+#endif
+
+[[noreturn]] void fail_plan(const std::filesystem::path& path, const char *what) {
+	std::ostringstream os;
+	os << "Not linking \"" << path.string() << "\": " << what << ".";
+	throw std::runtime_error(os.str());
+}
+
+// the current identity of a path without following links, false when it is no longer a regular file
+bool identify(Context& context, const Path& path, Candidate& found) {
+#ifdef _WIN32
+	const auto handle = ::CreateFileW(native(context.paths.full(path)).c_str(), FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr,
+		OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OPEN_REPARSE_POINT, nullptr);
+	if (handle == INVALID_HANDLE_VALUE) {
+		fail_plan(context.paths.full(path), last_error().c_str());
+	}
+	BY_HANDLE_FILE_INFORMATION information;
+	FILE_BASIC_INFO times;
+	const bool known = ::GetFileInformationByHandle(handle, &information) && ::GetFileInformationByHandleEx(handle, FileBasicInfo, &times, sizeof(times));
+	const auto error = last_error();
+	::CloseHandle(handle);
+	if (!known) {
+		fail_plan(context.paths.full(path), error.c_str());
+	}
+	if (information.dwFileAttributes & (FILE_ATTRIBUTE_DIRECTORY | FILE_ATTRIBUTE_REPARSE_POINT)) {
+		return false;
+	}
+	found = { path, (static_cast<uintmax_t>(information.nFileSizeHigh) << 32) | information.nFileSizeLow, information.dwVolumeSerialNumber,
+		(static_cast<uint64_t>(information.nFileIndexHigh) << 32) | information.nFileIndexLow, nanoseconds(times.LastWriteTime), nanoseconds(times.ChangeTime),
+		information.nNumberOfLinks };
+	return true;
+#else
+	struct stat st;
+	if (0 != ::fstatat(context.directories().get(path.directory), path.name, &st, AT_SYMLINK_NOFOLLOW)) {
+		fail_plan(context.paths.full(path), std::strerror(errno));
+	}
+	found = candidate(path, st);
+	return S_ISREG(st.st_mode);
+#endif
+}
+
+// false when the target already shares the extents of the base and nothing was done
+bool replace(Context& context, const Path& base, uint32_t directory, const char *name) {
+	const Timed timed(context.counters.link);
+	bool replaced = true;
+	switch (context.options.mode) {
+		case Mode::reflink:
+			replaced = reflink(context, base, directory, name);
+			break;
+#ifdef __linux__
+		case Mode::dedupe_range:
+			replaced = dedupe_range(context, base, directory, name);
+			break;
+#endif
+		default:
+			relink(context, base, directory, name);
+	}
+	if (!replaced) {
+		return false;
+	}
+
+	// the new link moved the ctime of the base, a clone the mtime and ctime of the target with the content unchanged,
+	// its cache record follows either; a stat that fails only costs a rehash
+	if (context.cache.enabled()) {
+		try {
+			Candidate current;
+			if (identify(context, { directory, name }, current)) {
+				context.cache.refresh(current, context.options.mode == Mode::reflink);
+			}
+		}
+		catch (const std::exception &) {
+		}
+	}
+	context.counters.links.fetch_add(1, std::memory_order_relaxed);
+	return true;
+}
+
+// a planned or incrementally listed entry is only linked while the stat of both files still matches what was hashed,
+// a target already on the base inode is skipped
+bool revalidate(Context& context, const Link& link) {
+	if (!link.check) {
+		return true;
+	}
+
+	const auto check = [&context](const Path& path, const Candidate& expected, Candidate& current) {
+		if (!identify(context, path, current) || current.device != expected.device) {
+			fail_plan(context.paths.full(path), "it is no longer the planned file");
+		}
+	};
+
+	Candidate base;
+	Candidate target;
+	check(link.base, link.expected_base, base);
+	check(link.target, link.expected_target, target);
+
+	if (base.inode == target.inode) {
+		return false;
+	}
+
+	// a rewrite in place can keep the size and restore the mtime, but not the ctime; linking moves the ctime as well, so it
+	// is only compared while the link count is the one that was hashed
+	const auto matches = [](const Candidate& current, const Candidate& expected) {
+		return current.inode == expected.inode && current.size == expected.size && current.mtime == expected.mtime
+			&& (current.ctime == expected.ctime || current.links != expected.links);
+	};
+	if (!matches(base, link.expected_base)) {
+		fail_plan(context.paths.full(link.target), "its base changed since it was hashed");
+	}
+	if (!matches(target, link.expected_target)) {
+		fail_plan(context.paths.full(link.target), "it changed since it was hashed");
+	}
+	return true;
+}
+
+// a walked file in streaming mode, carries its own name so no file table is kept while the tree is walked
+struct StreamRecord {
+	struct Fixed {
+		uint64_t size;
+		uint64_t device;
+		uint64_t inode;
+		int64_t mtime;
+		int64_t ctime;
+		uint64_t links;
+		uint32_t directory;
+		uint32_t length;
+	} fixed;
+	std::string name;
+
+	// paths of one inode end up next to each other
+	bool operator<(const StreamRecord& other) const {
+		return std::tie(fixed.size, fixed.device, fixed.inode) < std::tie(other.fixed.size, other.fixed.device, other.fixed.inode);
+	}
+
+	size_t footprint() const {
+		return sizeof(*this) + name.capacity();
+	}
+
+	void write(std::FILE *file) const {
+		std::fwrite(&fixed, sizeof(fixed), 1, file);
+		std::fwrite(name.data(), 1, name.size(), file);
+	}
+
+	bool read(std::FILE *file) {
+		if (1 != std::fread(&fixed, sizeof(fixed), 1, file)) {
+			return false;
+		}
+		name.resize(fixed.length);
+		return fixed.length == std::fread(name.data(), 1, fixed.length, file);
+	}
+
+	Candidate candidate() const {
+		return { { fixed.directory, name.c_str() }, fixed.size, fixed.device, fixed.inode, fixed.mtime, fixed.ctime, fixed.links };
+	}
+
+	static StreamRecord walked(const Candidate& file, const char *name) {
+		const std::string_view view(name);
+		return { { file.size, file.device, file.inode, file.mtime, file.ctime, file.links, file.path.directory, static_cast<uint32_t>(view.size()) }, std::string(view) };
+	}
+};
+
+// the walk is spilled sorted by size once it outgrows this budget unless a memory limit sets another one
+constexpr const std::size_t stream_budget { 1 << 28 };
+
+// hashes, groups and links one size bucket on its own, so nothing but the bucket is held in memory
+void stream_bucket(Context& context, const std::vector<StreamRecord>& bucket, std::atomic<uintmax_t>& saved) {
+	std::vector<Candidate> identities;
+	std::vector<std::vector<Path>> aliases;
+	for (const auto & record : bucket) {
+		if (!identities.empty() && identities.back().device == record.fixed.device && identities.back().inode == record.fixed.inode) {
+			// another path of a single link is the same file reached through two roots, not a link to move over
+			if (record.fixed.links > 1) {
+				aliases.back().push_back({ record.fixed.directory, record.name.c_str() });
+			}
+			continue;
+		}
+		identities.push_back(record.candidate());
+		aliases.emplace_back();
+	}
+
+	if (identities.size() < 2) {
+		return;
+	}
+
+	const auto size = identities.front().size;
+
+	// a bucket is merged in inode order, physical order reads it by placement instead
+	std::vector<size_t> sequence(identities.size());
+	for (size_t i = 0; i < sequence.size(); i++) {
+		sequence[i] = i;
+	}
+	if (context.options.order == Order::physical) {
+		std::vector<std::optional<uint64_t>> placements;
+		for (const auto & identity : identities) {
+			placements.push_back(placement(context, identity.path));
+		}
+		std::stable_sort(sequence.begin(), sequence.end(), [&placements](size_t a, size_t b) {
+			return std::make_pair(!placements[a], placements[a].value_or(0)) < std::make_pair(!placements[b], placements[b].value_or(0));
+		});
+	}
+
+	std::map<Digest, std::vector<size_t>> samples;
+	for (const auto i : sequence) {
+		try {
+			const auto *cached = context.cache.find(identities[i]);
+			samples[cached ? cached->sample : sample(context, identities[i].path, size)].push_back(i);
+		}
+		catch (const std::exception & e) {
+			context.error(e);
+		}
+	}
+
+	std::map<Digest, std::vector<const Candidate *>> groups;
+	for (const auto & [hash, members] : samples) {
+		for (const auto i : members) {
+			const auto &candidate = identities[i];
+			if (members.size() < 2) {
+				context.cache.store(candidate, hash, size <= 2 * block_size ? std::optional(hash) : std::nullopt);
+				continue;
+			}
+
+			try {
+				const auto *cached = context.cache.find(candidate);
+				const auto full = size <= 2 * block_size ? hash
+					: cached && (cached->flags & Cache::Record::has_digest) ? cached->digest : digest(context, candidate.path, size);
+				context.cache.store(candidate, hash, full);
+				groups[full].push_back(&candidate);
+			}
+			catch (const std::exception & e) {
+				context.error(e);
+			}
+		}
+	}
+
+	for (const auto & [hash, members] : groups) {
+		if (members.size() < 2) {
+			continue;
+		}
+
+		const bool compare = context.options.verify && context.options.mode != Mode::dedupe_range;
+		for (const auto & subgroup : compare ? verify_contents(context, members, size) : std::vector<std::vector<const Candidate *>> { members }) {
+			const auto base = subgroup.front()->path;
+
+			std::vector<std::vector<Path>> files;
+			for (auto it = subgroup.begin() + 1; it != subgroup.end(); ++it) {
+				auto &paths = files.emplace_back(std::vector<Path> { (*it)->path });
+				if (context.options.mode == Mode::hardlink) {
+					const auto &more = aliases[*it - identities.data()];
+					paths.insert(paths.end(), more.begin(), more.end());
+				}
+			}
+
+			context.counters.groups.fetch_add(1, std::memory_order_relaxed);
+			if (context.callbacks.group) {
+				context.callbacks.group(publish(context, { identities.front().device, size, hash }, subgroup, files));
+			}
+
+			for (size_t i = 0; i < files.size(); i++) {
+				bool done = true;
+				for (const auto & file : files[i]) {
+					if (context.options.dry_run) {
+						continue;
+					}
+					try {
+						if (context.options.incremental && !revalidate(context, { base, file, size, true, *subgroup.front(), *subgroup[i + 1] })) {
+							done = false;
+							continue;
+						}
+						if (!replace(context, base, file.directory, file.name)) {
+							done = false;
+						}
+					}
+					catch (const std::exception & e) {
+						context.error(e);
+						done = false;
+					}
+				}
+				if (done) {
+					saved += size;
+				}
+			}
+		}
+	}
+}
+
+// merges a spilled walk device and size at a time and hands every bucket that can hold duplicates to the workers
+uintmax_t stream(Context& context, Spill<StreamRecord>& spill) {
+	const auto workers = std::max(context.options.jobs, 1ul);
+	std::atomic<uintmax_t> saved { 0 };
+	Queue<std::vector<StreamRecord>> buckets(workers * 4);
+	std::vector<std::thread> threads;
+	for (unsigned long i = 0; i < workers; i++) {
+		threads.emplace_back([&] {
+			lower_priority(context.options);
+			std::vector<StreamRecord> bucket;
+			while (buckets.pop(bucket)) {
+				stream_bucket(context, bucket, saved);
+			}
+		});
+	}
+
+	try {
+		std::vector<StreamRecord> bucket;
+		spill.merge([&](StreamRecord record) {
+			if (!bucket.empty() && (bucket.front().fixed.size != record.fixed.size || bucket.front().fixed.device != record.fixed.device)) {
+				if (bucket.size() > 1) {
+					buckets.push(std::move(bucket));
+				}
+				bucket.clear();
+			}
+			bucket.push_back(std::move(record));
+		});
+		if (bucket.size() > 1) {
+			buckets.push(std::move(bucket));
+		}
+	}
+	catch (const std::exception & e) {
+		context.error(e);
+	}
+
+	buckets.close();
+	for (auto & thread : threads) {
+		thread.join();
+	}
+
+	return saved;
+}
+
+uintmax_t stream(Context& context, const std::vector<std::filesystem::path>& roots) {
+	Spill<StreamRecord> spill(context.options.memory_limit ? context.options.memory_limit : stream_budget);
+
+	Walker(context, [&spill](const Candidate& file, const char *name, Arena&) {
+		spill.add(StreamRecord::walked(file, name));
+	}).walk(roots);
+
+	return stream(context, spill);
+}
+
+// runs the planned links and returns the space they freed
+uintmax_t execute(Context& context, std::vector<Link>& links) {
+	// sorted by directory and name so every directory is one batch with a fixed order whatever the thread count
+	std::sort(links.begin(), links.end(), [](const Link& a, const Link& b) {
+		return a.target.directory != b.target.directory ? a.target.directory < b.target.directory : std::strcmp(a.target.name, b.target.name) < 0;
+	});
+
+	std::vector<size_t> batches;
+	for (size_t i = 0; i < links.size(); i++) {
+		if (i == 0 || links[i].target.directory != links[i - 1].target.directory) {
+			batches.push_back(i);
+		}
+	}
+	batches.push_back(links.size());
+
+	// a directory belongs to one thread only, so threads never contend for the same directory inside the filesystem
+	std::atomic<size_t> next_batch { 0 };
+	std::atomic<uintmax_t> linked { 0 };
+	std::vector<std::thread> linkers;
+	for (unsigned long n = 0; n < std::max(context.options.link_jobs, 1ul); n++) {
+		linkers.emplace_back([&] {
+			lower_priority(context.options);
+			for (size_t batch; (batch = next_batch++) + 1 < batches.size();) {
+				for (auto i = batches[batch]; i < batches[batch + 1]; i++) {
+					const auto &link = links[i];
+					try {
+						if (revalidate(context, link) && replace(context, link.base, link.target.directory, link.target.name)) {
+							linked += link.saved;
+						}
+					}
+					catch (const std::exception & e) {
+						context.error(e);
+					}
+				}
+			}
+		});
+	}
+	for (auto & thread : linkers) {
+		thread.join();
+	}
+	return linked;
+}
+
+}
+
+// files of a shared size are queued to the hashing workers as they come in, every full digest ends up in the sharded
+// index; with an order other than walk the queued files are held back until they can be sorted. Files up to two
+// blocks are hashed from a single read, so they are queued in batches that cost one queue operation together
+struct Grouper::State {
+	explicit State(Context& context) : context(context), workers(std::max(context.options.jobs, 1ul)), queue(workers * 64) {
+		for (unsigned long i = 0; i < workers; i++) {
+			threads.emplace_back([this] {
+				lower_priority(this->context.options);
+				std::vector<Candidate> batch;
+				while (queue.pop(batch)) {
+					for (const auto & candidate : batch) {
+						try {
+							hash_candidate(candidate);
+						}
+						catch (const std::exception & e) {
+							this->context.error(e);
+						}
+					}
+				}
+			});
+		}
+
+#ifdef HAVE_URING
+		if (context.options.io == Io::uring) {
+			for (unsigned long i = 0; i < workers; i++) {
+				engines.emplace_back([this] {
+					lower_priority(this->context.options);
+					try {
+						uring_digests();
+					}
+					catch (const std::exception & e) {
+						this->context.error(e);
+
+						// keep draining with plain reads, otherwise the hashing workers would block on a full queue
+						Pending job;
+						while (pending.pop(job)) {
+							try {
+								const auto full = digest(this->context, job.candidate.path, job.candidate.size);
+								this->context.cache.store(job.candidate, job.sample, full);
+								insert(job.candidate, full);
+							}
+							catch (const std::exception & e) {
+								this->context.error(e);
+							}
+						}
+					}
+				});
+			}
+		}
+#endif
+	}
+
+	~State() {
+		stop();
+	}
+
+	// hands on every candidate whose size is shared, the first file of a size is held back until then
+	void discover(Candidate candidate) {
+		charge(std::strlen(candidate.path.name) + 1);
+		if (candidate.links > 1) {
+			const Inode key { candidate.device, candidate.inode };
+			auto &shard = inode_shard(key);
+			std::lock_guard lock(shard.mutex);
+			auto [it, inserted] = shard.aliases.try_emplace(key);
+			charge(inserted ? alias_footprint : sizeof(Path));
+			if (!inserted) {
+				it->second.push_back(candidate.path);
+				return;
+			}
+		}
+
+		std::optional<Candidate> first;
+		{
+			auto &shard = sizes[candidate.size % sizes.size()];
+			std::lock_guard lock(shard.mutex);
+
+			// a file with unique size cannot have a duplicate, hold it back until the size shows up again
+			auto [it, inserted] = shard.sizes.try_emplace({ candidate.device, candidate.size }, candidate);
+			if (inserted) {
+				charge(size_footprint);
+				return;
+			}
+			first.swap(it->second);
+		}
+
+		if (first) {
+			submit(std::move(*first));
+		}
+		submit(std::move(candidate));
+	}
+
+	// an ordered queue can only be sorted once every file is discovered
+	void release() {
+		if (released) {
+			return;
+		}
+		released = true;
+		if (context.options.order != Order::walk) {
+			arrange(context, held, workers);
+
+			// a batch only takes small files that follow one another, so the arranged order is kept
+			std::vector<Candidate> batch;
+			for (auto & candidate : held) {
+				if (candidate.size > 2 * block_size) {
+					if (!batch.empty()) {
+						queue.push(std::move(batch));
+						batch.clear();
+					}
+					queue.push({ std::move(candidate) });
+					continue;
+				}
+				batch.push_back(std::move(candidate));
+				if (batch.size() == batch_size) {
+					queue.push(std::move(batch));
+					batch.clear();
+				}
+			}
+			if (!batch.empty()) {
+				queue.push(std::move(batch));
+			}
+			std::vector<Candidate>().swap(held);
+		}
+	}
+
+	// stops hashing without waiting for what is still queued or held back, the candidates in flight are finished
+	void abandon() {
+		std::vector<Candidate>().swap(held);
+		for (auto & batch : batches) {
+			std::lock_guard lock(batch.mutex);
+			batch.files.clear();
+		}
+		queue.discard();
+		stop();
+	}
+
+	// waits until every discovered file is hashed and indexed
+	void drain() {
+		release();
+		for (auto & batch : batches) {
+			std::lock_guard lock(batch.mutex);
+			if (!batch.files.empty()) {
+				queue.push(std::move(batch.files));
+				batch.files.clear();
+			}
+		}
+		stop();
+	}
+
+	// verifies a group of equal digests unless the kernel compares the content itself, every subgroup is counted and
+	// handed to found together with the paths of each duplicate inode; published subgroups also go to the group callback
+	template <typename Found>
+	void subgroups(const Key& key, const std::vector<const Candidate *>& listed, Found&& found) {
+		// an inode reached through two roots, such as a bind mount, is one member whatever its link count
+		std::unordered_set<Inode, Inode::Hash> seen;
+		std::vector<const Candidate *> members;
+		for (const auto *member : listed) {
+			if (seen.insert({ member->device, member->inode }).second) {
+				members.push_back(member);
+			}
+		}
+		if (members.size() < 2) {
+			return;
+		}
+
+		const bool compare = context.options.verify && context.options.mode != Mode::dedupe_range;
+		for (const auto & subgroup : compare ? verify_contents(context, members, key.size) : std::vector<std::vector<const Candidate *>> { members }) {
+			std::vector<std::vector<Path>> files;
+			for (auto it = subgroup.begin() + 1; it != subgroup.end(); ++it) {
+				files.push_back(this->files(**it));
+			}
+			context.counters.groups.fetch_add(1, std::memory_order_relaxed);
+			found(subgroup, files);
+		}
+	}
+
+	// visits every group with at least two members, from the in-memory index or, once spilled, from the merged runs
+	template <typename Callback>
+	void for_each_group(Callback&& callback) {
+		if (!group_spill) {
+			for (const auto & shard : shards) {
+				for (const auto & [key, chain] : shard.table) {
+					if (chain.count < 2) {
+						continue;
+					}
+
+					std::vector<const Candidate *> members { &shard.members[chain.first].candidate };
+					for (auto index = shard.members[chain.first].next; index; index = shard.members[index].next) {
+						members.push_back(&shard.members[index].candidate);
+					}
+					callback(key, members);
+				}
+			}
+			return;
+		}
+
+		for (auto & shard : shards) {
+			for (const auto & [key, chain] : shard.table) {
+				for (auto index = chain.first;; index = shard.members[index].next) {
+					group_spill->add({ key, shard.members[index].candidate });
+					if (index == chain.last) {
+						break;
+					}
+				}
+			}
+			shard.table.clear();
+			shard.members = {};
+		}
+
+		std::optional<Key> current;
+		std::vector<Candidate> candidates;
+		const auto flush = [&] {
+			if (candidates.size() > 1) {
+				std::vector<const Candidate *> members;
+				for (const auto & candidate : candidates) {
+					members.push_back(&candidate);
+				}
+				callback(*current, members);
+			}
+			candidates.clear();
+		};
+
+		group_spill->merge([&](GroupRecord record) {
+			if (current && !(*current == record.key)) {
+				flush();
+			}
+			current = record.key;
+			candidates.push_back(record.candidate);
+		});
+		flush();
+	}
+
+	InodeShard& inode_shard(const Inode& key) {
+		return inodes[Inode::Hash()(key) % inodes.size()];
+	}
+
+	// small files wait in a batch of the submitting thread, a full batch is queued outside its lock
+	void submit(Candidate candidate) {
+		if (context.options.order != Order::walk) {
+			charge(sizeof(Candidate));
+			std::lock_guard lock(held_mutex);
+			held.push_back(std::move(candidate));
+			return;
+		}
+		if (candidate.size > 2 * block_size) {
+			queue.push({ std::move(candidate) });
+			return;
+		}
+
+		auto &batch = batches[std::hash<std::thread::id>()(std::this_thread::get_id()) % batches.size()];
+		std::vector<Candidate> full;
+		{
+			std::lock_guard lock(batch.mutex);
+			batch.files.push_back(std::move(candidate));
+			if (batch.files.size() < batch_size) {
+				return;
+			}
+			full.swap(batch.files);
+		}
+		queue.push(std::move(full));
+	}
+
+	void stop() {
+		if (stopped) {
+			return;
+		}
+		stopped = true;
+		queue.close();
+		for (auto & thread : threads) {
+			thread.join();
+		}
+		pending.close();
+		for (auto & thread : engines) {
+			thread.join();
+		}
+		samples.clear();
+	}
+
+	// every path of a duplicate inode is moved over, paths already on the base inode are never touched;
+	// a clone replaces the content of the inode, so there it is enough to handle one of its paths
+	std::vector<Path> files(const Candidate& member) {
+		std::vector<Path> files { member.path };
+		if (member.links > 1 && context.options.mode == Mode::hardlink) {
+			const Inode key { member.device, member.inode };
+			auto &shard = inode_shard(key);
+			std::lock_guard lock(shard.mutex);
+			const auto &aliases = shard.aliases[key];
+			files.insert(files.end(), aliases.begin(), aliases.end());
+		}
+		return files;
+	}
+
+	// the limit is split in four: the in-memory index, the sort buffer of its spill, the sort buffer of the spilled
+	// walk and the tables of the walk
+	uintmax_t index_budget() const {
+		return std::max<uintmax_t>(context.options.memory_limit / 4, 1 << 20);
+	}
+
+	// the first files of every size and sample, the paths of duplicate inodes, the held back files and the names; only
+	// counted under a memory limit, none of it is given back before the grouper is done
+	void charge(size_t bytes) {
+		if (context.options.memory_limit) {
+			tables.fetch_add(bytes, std::memory_order_relaxed);
+		}
+	}
+
+	// past its share of the limit the session stops adding to the grouper and groups from the spilled walk instead
+	bool over_budget() const {
+		return context.options.memory_limit && tables.load(std::memory_order_relaxed) > index_budget();
+	}
+
+	// moves every shard into sorted runs, inserts keep going into the emptied shards meanwhile
+	void spill_index() {
+		std::lock_guard guard(spilling);
+		if (indexed * member_footprint <= index_budget()) {
+			return;
+		}
+
+		if (!group_spill) {
+			group_spill = std::make_unique<Spill<GroupRecord>>(index_budget());
+		}
+
+		for (auto & shard : shards) {
+			std::lock_guard lock(shard.mutex);
+			for (const auto & [key, chain] : shard.table) {
+				for (auto index = chain.first;; index = shard.members[index].next) {
+					group_spill->add({ key, shard.members[index].candidate });
+					if (index == chain.last) {
+						break;
+					}
+				}
+			}
+			indexed -= shard.members.size();
+			shard.table.clear();
+			shard.members = {};
+		}
+	}
+
+	void insert(const Candidate& candidate, const Digest& hash) {
+		{
+			auto &shard = shards[hash[0] % shards.size()];
+			std::lock_guard lock(shard.mutex);
+
+			auto [chain, inserted] = shard.table.emplace({ candidate.device, candidate.size, hash });
+			const auto index = static_cast<uint32_t>(shard.members.size());
+			shard.members.push_back({ candidate, 0 });
+			if (inserted) {
+				chain.first = index;
+			}
+			else {
+				shard.members[chain.last].next = index;
+			}
+			chain.last = index;
+			chain.count++;
+		}
+
+		if (context.options.memory_limit && ++indexed * member_footprint > index_budget()) {
+			spill_index();
+		}
+	}
+
+#ifdef HAVE_URING
+	// keeps up to uring_depth files in flight with one outstanding read each, completions feed their hashers
+	void uring_digests() {
+		struct Slot {
+			Pending job;
+			std::unique_ptr<File> file;
+			std::unique_ptr<Digester> hasher;
+			uint64_t offset;
+			unsigned char *buffer;
+			std::chrono::steady_clock::time_point submitted;
+		};
+
+		Ring ring(uring_depth);
+		const std::unique_ptr<unsigned char, decltype(&std::free)> buffers(static_cast<unsigned char *>(std::aligned_alloc(4096, uring_depth * uring_buffer_size)), &std::free);
+		if (!buffers) {
+			throw std::bad_alloc();
+		}
+
+		std::vector<Slot> slots(uring_depth);
+		std::vector<size_t> free;
+		for (size_t i = 0; i < slots.size(); i++) {
+			slots[i].buffer = buffers.get() + i * uring_buffer_size;
+			free.push_back(i);
+		}
+
+		// every read takes its tokens before it is queued and is timed from there to its completion
+		const auto read = [&](size_t tag) {
+			auto &slot = slots[tag];
+			context.throttle.acquire();
+			slot.submitted = std::chrono::steady_clock::now();
+			ring.read(slot.file->fd, slot.buffer, uring_buffer_size, slot.offset, tag);
+		};
+
+		bool open = true;
+		while (true) {
+			// block for new work only when nothing is in flight
+			while (open && !free.empty()) {
+				auto &slot = slots[free.back()];
+				if (free.size() == slots.size() ? !pending.pop(slot.job) : !pending.try_pop(slot.job)) {
+					open = free.size() != slots.size();
+					break;
+				}
+
+				try {
+					slot.file = std::make_unique<File>(context, slot.job.candidate.path);
+				}
+				catch (const std::exception & e) {
+					context.error(e);
+					continue;
+				}
+
+				slot.hasher = make_digester(context.options.algorithm);
+				slot.offset = 0;
+				read(free.back());
+				free.pop_back();
+			}
+
+			if (free.size() == slots.size()) {
+				if (!open) {
+					return;
+				}
+				continue;
+			}
+
+			ring.wait([&](uint64_t tag, int result) {
+				auto &slot = slots[tag];
+
+				if (result == -EINTR || result == -EAGAIN) {
+					read(tag);
+					return;
+				}
+				context.counters.read.record(std::chrono::steady_clock::now() - slot.submitted);
+
+				if (result > 0) {
+					context.throttle.consume(result);
+					slot.hasher->update(slot.buffer, result);
+					context.counters.hashed.fetch_add(result, std::memory_order_relaxed);
+					slot.offset += result;
+					read(tag);
+					return;
+				}
+
+				if (result < 0) {
+					context.error("Cannot read \"" + slot.file->path().string() + "\": " + std::strerror(-result) + ".");
+				}
+				else {
+					const auto full = slot.hasher->final();
+					context.cache.store(slot.job.candidate, slot.job.sample, full);
+					insert(slot.job.candidate, full);
+				}
+
+				slot.file.reset();
+				slot.hasher.reset();
+				free.push_back(tag);
+			});
+		}
+	}
+#endif
+
+	// full digest of a candidate whose sample collided, taken from the cache when the inode is unchanged
+	void hash_fully(const Candidate& candidate, const Digest& hash) {
+		const auto *cached = context.cache.find(candidate);
+		if (context.options.io == Io::uring && !(cached && (cached->flags & Cache::Record::has_digest))) {
+			pending.push({ candidate, hash });
+			return;
+		}
+		const auto full = cached && (cached->flags & Cache::Record::has_digest) ? cached->digest : digest(context, candidate.path, candidate.size);
+		context.cache.store(candidate, hash, full);
+		insert(candidate, full);
+	}
+
+	void hash_candidate(const Candidate& candidate) {
+		const auto *cached = context.cache.find(candidate);
+		const auto hash = cached ? cached->sample : sample(context, candidate.path, candidate.size);
+
+		if (candidate.size <= 2 * block_size) {
+			context.cache.store(candidate, hash, hash);
+			insert(candidate, hash);
+			return;
+		}
+
+		// cheap sample first, files differing in the first or the last block are never read in full
+		std::optional<Candidate> first;
+		{
+			std::lock_guard lock(samples_mutex);
+			auto [entry, inserted] = samples.emplace({ candidate.device, candidate.size, hash });
+			if (inserted) {
+				charge(sample_footprint);
+				entry = candidate;
+				context.cache.store(candidate, hash, cached && (cached->flags & Cache::Record::has_digest) ? std::optional(cached->digest) : std::nullopt);
+				return;
+			}
+			first.swap(entry);
+		}
+
+		if (first) {
+			hash_fully(*first, hash);
+		}
+		hash_fully(candidate, hash);
+	}
+
+	Context& context;
+	const unsigned long workers;
+	std::array<SizeShard, 64> sizes;
+	std::array<InodeShard, 64> inodes;
+
+	// the first file of every (device, size, sample), reset once the sample collides and both files are hashed in full
+	Table<std::optional<Candidate>> samples;
+	std::mutex samples_mutex;
+
+	// zero memory limit keeps everything in memory, otherwise the index moves into sorted runs once it outgrows the limit
+	std::array<Shard, 64> shards;
+	std::unique_ptr<Spill<GroupRecord>> group_spill;
+	std::atomic<size_t> indexed { 0 };
+	std::mutex spilling;
+	std::atomic<uintmax_t> tables { 0 };
+
+	struct Batch {
+		std::mutex mutex;
+		std::vector<Candidate> files;
+	};
+
+	static constexpr size_t batch_size = 64;
+	std::array<Batch, 64> batches;
+	Queue<std::vector<Candidate>> queue;
+	Queue<Pending> pending { 4096 };
+	std::mutex held_mutex;
+	std::vector<Candidate> held;
+	bool released = false;
+	bool stopped = false;
+	std::vector<std::thread> threads;
+	std::vector<std::thread> engines;
+};
+
+bool available(Algorithm algorithm) {
+	switch (algorithm) {
+		case Algorithm::sha256:
+			return true;
+		case Algorithm::blake3:
+#ifdef HAVE_BLAKE3
+			return true;
+#else
+			return false;
+#endif
+		case Algorithm::xxh3:
+#ifdef HAVE_XXHASH
+			return true;
+#else
+			return false;
+#endif
+	}
+	return false;
+}
+
+bool available([[maybe_unused]] Mode mode) {
+#ifdef __linux__
+	return true;
+#else
+	return mode != Mode::dedupe_range;
+#endif
+}
+
+Session::Session(Options options, Callbacks callbacks) : context(std::make_unique<Context>(std::move(options), std::move(callbacks))) {
+	auto &context = *this->context;
+	const auto &chosen = context.options;
+	if (!available(chosen.algorithm)) {
+		throw std::invalid_argument("the hash algorithm is not available in this build");
+	}
+	if (!available(chosen.mode)) {
+		throw std::invalid_argument("the link mode is not available on this platform");
+	}
+	if (chosen.incremental && chosen.cache.empty()) {
+		throw std::invalid_argument("incremental needs a cache");
+	}
+
+	// empty files are never linked, whatever the minimum
+	context.filter.sizes(std::max<uintmax_t>(chosen.min_size, 1), chosen.max_size);
+	for (const auto & pattern : chosen.include) {
+		context.filter.include(pattern);
+	}
+	for (const auto & pattern : chosen.exclude) {
+		context.filter.exclude(pattern);
+	}
+	for (const auto & pattern : chosen.prune) {
+		context.filter.prune(pattern);
+	}
+
+	context.throttle.configure(chosen.io_rate, chosen.iops, chosen.io_latency);
+
+	const auto warning = [&context](const std::string& message) {
+		context.warning(message);
+	};
+	if (!chosen.cache.empty()) {
+		context.cache.load(chosen.cache, chosen.algorithm, warning);
+	}
+	if (chosen.incremental) {
+		context.snapshot.load(chosen.cache + ".dirs", context.filter.fingerprint(), warning);
+	}
+
+#ifdef HAVE_URING
+	if (chosen.io == Io::uring) {
+		try {
+			Ring probe(uring_depth);
+			if (!probe.supports(IORING_OP_READ)) {
+				throw std::runtime_error("io_uring cannot read on this kernel.");
+			}
+		}
+		catch (const std::exception & e) {
+			context.warning(std::string(e.what()) + " Falling back to read.");
+			context.options.io = Io::read;
+		}
+	}
+#else
+	if (chosen.io == Io::uring) {
+		context.warning("io_uring is not available on this platform. Falling back to read.");
+		context.options.io = Io::read;
+	}
+#endif
+}
+
+Session::~Session() = default;
+
+uintmax_t Session::deduplicate(const std::vector<std::filesystem::path>& roots) {
+	auto &context = *this->context;
+	const auto save = [&context] {
+		try {
+			context.save();
+		}
+		catch (const std::exception & e) {
+			context.error(e);
+		}
+	};
+
+	if (context.options.stream) {
+		const auto saved = stream(context, roots);
+		save();
+		context.phase("stream");
+		return saved;
+	}
+
+	// under a memory limit the walk is spilled as well, once the tables of the grouper outgrow their share the files
+	// are grouped a size at a time from the spill like with stream; the queued hashing is dropped then, what was hashed
+	// until then is settled and reused by the stream as long as there is a cache to hold it
+	std::unique_ptr<Spill<StreamRecord>> walked;
+	auto grouper = std::make_unique<Grouper>(*this);
+	auto &state = *grouper->state;
+	if (context.options.memory_limit) {
+		walked = std::make_unique<Spill<StreamRecord>>(state.index_budget());
+	}
+
+	std::atomic<bool> overflowed { false };
+	Walker(context, [&](const Candidate& file, const char *name, Arena& arena) {
+		if (walked) {
+			walked->add(StreamRecord::walked(file, name));
+			if (overflowed.load(std::memory_order_relaxed)) {
+				return;
+			}
+			if (state.over_budget()) {
+				overflowed.store(true, std::memory_order_relaxed);
+				return;
+			}
+		}
+		auto found = file;
+		found.path.name = arena.intern(name);
+		state.discover(std::move(found));
+	}).walk(roots);
+	context.phase("walk");
+
+	if (overflowed) {
+		state.abandon();
+		grouper.reset();
+		context.cache.settle();
+		const auto saved = stream(context, *walked);
+		save();
+		context.phase("stream");
+		return saved;
+	}
+	walked.reset();
+
+	if (context.options.order != Order::walk) {
+		state.release();
+		context.phase("order");
+	}
+
+	state.drain();
+	context.phase("hash");
+
+	// an incremental run may replay entries that changed since, so every link is checked right before it is made
+	std::vector<Link> links;
+	lowered(context.options, [&] {
+		state.for_each_group([&](const Key& key, const std::vector<const Candidate *>& members) {
+			state.subgroups(key, members, [&](const std::vector<const Candidate *>& subgroup, const std::vector<std::vector<Path>>& files) {
+				if (context.callbacks.group) {
+					context.callbacks.group(publish(context, key, subgroup, files));
+				}
+				for (size_t i = 0; i < files.size(); i++) {
+					for (const auto & file : files[i]) {
+						// the space is freed once the last path of the member inode is gone
+						links.push_back({ subgroup.front()->path, file, &file == &files[i].back() ? key.size : 0, context.options.incremental, *subgroup.front(), *subgroup[i + 1] });
+					}
+				}
+			});
+		});
+	});
+	context.phase("group");
+
+	uintmax_t saved = 0;
+	if (context.options.dry_run) {
+		for (const auto & link : links) {
+			saved += link.saved;
+		}
+		links.clear();
+	}
+	saved += execute(context, links);
+
+	// saved only now, every link moves the ctime of its base and the cache follows it
+	save();
+	context.phase("link");
+	return saved;
+}
+
+void Session::save() {
+	context->save();
+}
+
+const Options& Session::options() const {
+	return context->options;
+}
+
+const Counters& Session::counters() const {
+	return context->counters;
+}
+
+Scanner::Scanner(Session& session) : context(*session.context) {}
+
+void Scanner::scan(const std::vector<std::filesystem::path>& roots, const std::function<void(const FileInfo& file)>& found) {
+	Walker(context, [this, &found](const Candidate& file, const char *name, Arena& arena) {
+		auto listed = file;
+		listed.path.name = arena.intern(name);
+		found(context.info(listed));
+	}).walk(roots);
+}
+
+Hasher::Hasher(Session& session) : context(*session.context) {}
+
+Digest Hasher::sample(const FileInfo& file) {
+	const auto candidate = context.candidate(file);
+	const auto *cached = context.cache.find(candidate);
+	return cached ? cached->sample : hrdups::sample(context, candidate.path, candidate.size);
+}
+
+Digest Hasher::digest(const FileInfo& file) {
+	const auto candidate = context.candidate(file);
+	const auto *cached = context.cache.find(candidate);
+	const auto hash = cached ? cached->sample : hrdups::sample(context, candidate.path, candidate.size);
+	const auto full = candidate.size <= 2 * block_size ? hash
+		: cached && (cached->flags & Cache::Record::has_digest) ? cached->digest : hrdups::digest(context, candidate.path, candidate.size);
+	context.cache.store(candidate, hash, full);
+	return full;
+}
+
+Grouper::Grouper(Session& session) : state(std::make_unique<State>(*session.context)) {}
+
+Grouper::~Grouper() = default;
+
+void Grouper::add(const FileInfo& file) {
+	state->discover(state->context.candidate(file));
+}
+
+void Grouper::groups(const std::function<void(const Group& group)>& callback) {
+	auto &context = state->context;
+	state->drain();
+	lowered(context.options, [&] {
+		state->for_each_group([&](const Key& key, const std::vector<const Candidate *>& members) {
+			state->subgroups(key, members, [&](const std::vector<const Candidate *>& subgroup, const std::vector<std::vector<Path>>& files) {
+				const auto group = publish(context, key, subgroup, files);
+				if (context.callbacks.group) {
+					context.callbacks.group(group);
+				}
+				callback(group);
+			});
+		});
+	});
+}
+
+Linker::Linker(Session& session) : context(*session.context) {}
+
+uintmax_t Linker::link(const std::vector<Group>& groups, bool revalidate) {
+	std::vector<Link> links;
+	for (const auto & group : groups) {
+		if (group.duplicates.empty()) {
+			continue;
+		}
+		const auto base = context.candidate(group.base);
+		const auto first = links.size();
+		for (const auto & duplicate : group.duplicates) {
+			const auto target = context.candidate(duplicate);
+			links.push_back({ base.path, target.path, group.size, revalidate, base, target });
+		}
+
+		// the space of an inode is only freed with its last path, which follow one another in a group
+		for (auto i = first; i + 1 < links.size(); i++) {
+			if (links[i].expected_target.device == links[i + 1].expected_target.device && links[i].expected_target.inode == links[i + 1].expected_target.inode) {
+				links[i].saved = 0;
+			}
+		}
+	}
+
+	// a dry run only counts what would still be linked, a plan gone stale shows up without touching anything
+	if (context.options.dry_run) {
+		uintmax_t saved = 0;
+		for (const auto & link : links) {
+			try {
+				if (hrdups::revalidate(context, link)) {
+					saved += link.saved;
+				}
+			}
+			catch (const std::exception & e) {
+				context.error(e);
+			}
+		}
+		return saved;
+	}
+	return execute(context, links);
+}
+
+}
@@ -0,0 +1,296 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// finds files with identical content and replaces the copies by hardlinks or clones of one of them; a Session holds
+// everything one deduplication needs, the components only ever share state through the session they were made from:
+//
+//   hrdups::Session session(options, callbacks);
+//   const auto saved = session.deduplicate({ "/srv/artifacts" });
+//
+// or piece by piece, for files that are known without a walk:
+//
+//   hrdups::Grouper grouper(session);
+//   grouper.add(file);
+//   grouper.groups([&](const hrdups::Group& group) { linker.link(group); });
+namespace hrdups {
+
+// large enough for the strongest algorithm, shorter digests are zero padded
+using Digest = std::array<unsigned char, 32>;
+
+enum class Algorithm : uint32_t {
+	sha256,
+	blake3,
+	xxh3,
+};
+
+// mmap installs a process-wide SIGBUS handler on its first mapping, so a file truncated while it is hashed is read
+// instead of ending the process; any other SIGBUS is passed on to the handler that was installed before
+enum class Io {
+	read,
+	mmap,
+	uring,
+};
+
+enum class Mode {
+	hardlink,
+	reflink,
+	dedupe_range,
+};
+
+// the order hashed files are read in, walk keeps hashing overlapped with the walk
+enum class Order {
+	walk,
+	inode,
+	physical,
+};
+
+// whether this build and platform offer an algorithm or mode at all
+bool available(Algorithm algorithm);
+bool available(Mode mode);
+
+struct Options {
+	// walking: sizes outside the bounds are skipped, patterns with a slash match the whole path and others the name
+	unsigned long walkers = std::thread::hardware_concurrency();
+	uintmax_t min_size = 1;
+	uintmax_t max_size = UINTMAX_MAX;
+	std::vector<std::string> include;
+	std::vector<std::string> exclude;
+	std::vector<std::string> prune;
+
+	// hashing: the cache keeps digests of unchanged inodes across sessions, incremental also replays unchanged directories
+	unsigned long jobs = std::thread::hardware_concurrency();
+	Algorithm algorithm = Algorithm::sha256;
+	Io io = Io::read;
+	Order order = Order::walk;
+	std::string cache;
+	bool incremental = false;
+
+	// throttling of every read, zero leaves a limit off; with a latency target the limits back off while the slow tail
+	// of the reads is above it. idle_io and nice lower the priority of the threads of the session, not of the caller
+	uintmax_t io_rate = 0;
+	unsigned long iops = 0;
+	std::chrono::microseconds io_latency { 0 };
+	bool idle_io = false;
+	int nice = 0;
+
+	// grouping: stream groups one size at a time from a sorted spill of the walk. A memory limit spills the index and
+	// switches Session::deduplicate() to streaming once the tables of the walk outgrow their share; the digest cache,
+	// the planned links and the files given to Grouper::add() are not bounded by it
+	uintmax_t memory_limit = 0;
+	bool stream = false;
+	bool verify = false;
+
+	// linking: a dry run reports everything it would do and leaves the filesystem alone
+	Mode mode = Mode::hardlink;
+	unsigned long link_jobs = std::thread::hardware_concurrency();
+	bool dry_run = false;
+};
+
+// a regular file as it was listed, the identity of its inode is what a later link is revalidated against
+struct FileInfo {
+	std::filesystem::path path;
+	uintmax_t size = 0;
+	uint64_t device = 0;
+	uint64_t inode = 0;
+	int64_t mtime = 0;
+	int64_t ctime = 0;
+	uint64_t links = 1;
+};
+
+// files of one device with the same size and digest, every duplicate path is replaced by the base; further paths
+// of a duplicate inode follow it directly and share its identity
+struct Group {
+	uint64_t device = 0;
+	uintmax_t size = 0;
+	Digest digest {};
+	FileInfo base;
+	std::vector<FileInfo> duplicates;
+};
+
+// all of them may be called from several threads at once
+struct Callbacks {
+	// a failure that only costs one file or directory, the run goes on
+	std::function<void(const std::string& message)> error;
+
+	// something about the run itself, such as a cache that cannot be used
+	std::function<void(const std::string& message)> warning;
+
+	// every group found, before any of its files is linked
+	std::function<void(const Group& group)> group;
+
+	// the end of a phase of Session::deduplicate(): walk, order, hash, group, link or stream
+	std::function<void(const char *phase)> phase;
+};
+
+// latencies in power of two microsecond buckets, recorded from any thread without a lock
+class Histogram {
+public:
+	void record(std::chrono::steady_clock::duration elapsed) {
+		const auto micros = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+		size_t bucket = 0;
+		while (bucket + 1 < buckets.size() && (uint64_t(1) << bucket) <= micros) {
+			bucket++;
+		}
+		buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+	}
+
+	// "<name>  <count> calls  <1us:n  <2us:n ...", only the buckets that were hit
+	void print(std::ostream& out, const char *name) const {
+		uint64_t total = 0;
+		for (const auto & bucket : buckets) {
+			total += bucket.load(std::memory_order_relaxed);
+		}
+		out << '\t' << name << '\t' << total << " calls";
+		for (size_t i = 0; i < buckets.size(); i++) {
+			if (const auto count = buckets[i].load(std::memory_order_relaxed)) {
+				out << "  <" << format_micros(uint64_t(1) << i) << ':' << count;
+			}
+		}
+		out << std::endl;
+	}
+
+	// the calls recorded so far per bucket, bucket i holds those under 2^i microseconds
+	std::array<uint64_t, 32> counts() const {
+		std::array<uint64_t, 32> counts;
+		for (size_t i = 0; i < buckets.size(); i++) {
+			counts[i] = buckets[i].load(std::memory_order_relaxed);
+		}
+		return counts;
+	}
+
+private:
+	static std::string format_micros(uint64_t micros) {
+		return micros < 1000 ? std::to_string(micros) + "us" : micros < 1000000 ? std::to_string(micros / 1000) + "ms" : std::to_string(micros / 1000000) + "s";
+	}
+
+	std::array<std::atomic<uint64_t>, 32> buckets {};
+};
+
+// relaxed counters bumped by every thread of a session, safe to read while it runs
+struct Counters {
+	std::atomic<uint64_t> files { 0 };
+	std::atomic<uint64_t> filtered { 0 };
+	std::atomic<uint64_t> hashed { 0 };
+	std::atomic<uint64_t> groups { 0 };
+	std::atomic<uint64_t> links { 0 };
+	std::atomic<uint64_t> errors { 0 };
+	Histogram open;
+	Histogram read;
+	Histogram link;
+};
+
+struct Context;
+
+// the options, callbacks, counters, directory tree, digest cache and directory snapshot shared by the components made
+// from it; it has to outlive them
+class Session {
+public:
+	// loads the cache and the snapshot of options.cache, throws std::invalid_argument for options that do not fit together
+	explicit Session(Options options, Callbacks callbacks = {});
+	~Session();
+
+	Session(const Session&) = delete;
+	Session& operator=(const Session&) = delete;
+
+	// walks, hashes, groups and links the roots and returns the bytes freed, or that would be freed in a dry run;
+	// it saves the cache and the snapshot when it is done
+	uintmax_t deduplicate(const std::vector<std::filesystem::path>& roots);
+
+	// writes the digests and listings of this session back to options.cache
+	void save();
+
+	const Options& options() const;
+	const Counters& counters() const;
+
+private:
+	friend class Scanner;
+	friend class Hasher;
+	friend class Grouper;
+	friend class Linker;
+
+	std::unique_ptr<Context> context;
+};
+
+// lists directory trees with the walkers of the session, honoring its filters and its snapshot
+class Scanner {
+public:
+	explicit Scanner(Session& session);
+
+	// hands every regular, non-empty file that passed the filters to found, from the walker threads; a root that is,
+	// or is inside, another root is skipped, also when it is reached through a symlink or a bind mount. A bind mount
+	// further down can still lead into another root, a file found twice that way is only grouped once
+	void scan(const std::vector<std::filesystem::path>& roots, const std::function<void(const FileInfo& file)>& found);
+
+private:
+	Context& context;
+};
+
+// digests in the algorithm of the session, taken from its cache while the inode is unchanged
+class Hasher {
+public:
+	explicit Hasher(Session& session);
+
+	// the first and the last block only, for files up to two blocks this already is the digest
+	Digest sample(const FileInfo& file);
+
+	Digest digest(const FileInfo& file);
+
+private:
+	Context& context;
+};
+
+// size-first grouping: a file is only sampled once its size is shared and only hashed in full once its sample is,
+// the hashing runs on the workers of the session while files are still being added
+class Grouper {
+public:
+	explicit Grouper(Session& session);
+	~Grouper();
+
+	Grouper(const Grouper&) = delete;
+	Grouper& operator=(const Grouper&) = delete;
+
+	// any thread may add files, every path of an inode with several links has to be added
+	void add(const FileInfo& file);
+
+	// waits for the hashing and hands every group to callback, verified byte for byte with options.verify; once only.
+	// With idle_io or nice the groups are visited from a thread of the session, so the verification runs lowered too
+	void groups(const std::function<void(const Group& group)>& callback);
+
+private:
+	friend class Session;
+
+	struct State;
+	std::unique_ptr<State> state;
+};
+
+// replaces duplicates by the base of their group in the mode of the session, a failure at any point leaves either
+// the old or the new file in place
+class Linker {
+public:
+	explicit Linker(Session& session);
+
+	// links every duplicate and returns the bytes freed, the space of an inode counts once its last listed path is
+	// replaced; with revalidate both files are checked against their identities right before every link, for groups
+	// that were planned earlier or read back from a report
+	uintmax_t link(const std::vector<Group>& groups, bool revalidate = true);
+
+	uintmax_t link(const Group& group, bool revalidate = true) {
+		return link(std::vector<Group> { group }, revalidate);
+	}
+
+private:
+	Context& context;
+};
+
+}
@@ -1,133 +1,742 @@
+#include "hrdups.h"
+
 #include <iostream>
 #include <filesystem>
+#include <chrono>
+#include <condition_variable>
+#include <cctype>
+#include <cstdint>
 #include <cstring>
+#include <cstdio>
 #include <fstream>
-#include <map>
+#include <iomanip>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <thread>
 #include <vector>
-#include <openssl/sha.h>
 
-std::map<std::string, std::pair<size_t, std::vector<std::string>>> map;
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <io.h>
+#else
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+
+using hrdups::Algorithm;
+using hrdups::Io;
+using hrdups::Mode;
+using hrdups::Order;
+
+// a failure that only costs one file or directory, or something about the run, the run goes on
+void print_error(const std::string& message) {
+	std::cerr << message << std::endl;
+}
 
-void traverse(const std::filesystem::path& path) {
-	for (const auto & entry : std::filesystem::directory_iterator(path)) {
-		const auto& entry_path = entry.path();
-		if (!entry.is_symlink()) {
-			if (entry.is_directory()) {
-				traverse(entry_path);
+// rewrites one line on a terminal, or prints one line per period when redirected
+class Progress {
+public:
+	void start(const hrdups::Counters& counters, std::chrono::milliseconds period) {
+		thread = std::thread([this, &counters, period] {
+#ifdef _WIN32
+			const bool terminal = ::_isatty(::_fileno(stderr));
+#else
+			const bool terminal = ::isatty(STDERR_FILENO);
+#endif
+			auto last = std::chrono::steady_clock::now();
+			uint64_t files = 0;
+			uint64_t hashed = 0;
+			std::unique_lock lock(mutex);
+			while (!stopped.wait_for(lock, period, [this] { return stop; })) {
+				const auto now = std::chrono::steady_clock::now();
+				const auto seconds = std::chrono::duration<double>(now - last).count();
+				const auto current_files = counters.files.load(std::memory_order_relaxed);
+				const auto current_hashed = counters.hashed.load(std::memory_order_relaxed);
+				std::ostringstream line;
+				line << std::fixed << std::setprecision(1) << current_files << " files (" << (current_files - files) / seconds << "/s), "
+				     << (double)current_hashed / (1024 * 1024) << "MiB hashed (" << (current_hashed - hashed) / seconds / (1024 * 1024) << "MiB/s), "
+				     << counters.groups.load(std::memory_order_relaxed) << " groups, " << counters.links.load(std::memory_order_relaxed) << " links, "
+				     << counters.errors.load(std::memory_order_relaxed) << " errors";
+				std::cerr << (terminal ? "\r\x1b[K" : "") << line.str() << (terminal ? "" : "\n") << std::flush;
+				last = now;
+				files = current_files;
+				hashed = current_hashed;
+			}
+			if (terminal) {
+				std::cerr << "\r\x1b[K" << std::flush;
 			}
-			if (entry.is_regular_file()) {
+		});
+	}
+
+	~Progress() {
+		if (thread.joinable()) {
+			{
+				std::lock_guard lock(mutex);
+				stop = true;
+			}
+			stopped.notify_all();
+			thread.join();
+		}
+	}
+
+private:
+	std::thread thread;
+	std::mutex mutex;
+	std::condition_variable stopped;
+	bool stop = false;
+};
+
+// a byte count with an optional K, M, G or T binary suffix
+uintmax_t parse_size(const std::string& text) {
+	size_t end;
+	const auto value = std::stoull(text, &end);
+	const auto suffix = text.substr(end);
+	if (suffix.empty()) {
+		return value;
+	}
+	const std::string units = "KMGT";
+	const auto unit = units.find(static_cast<char>(std::toupper(static_cast<unsigned char>(suffix.front()))));
+	if (unit == std::string::npos || (suffix.size() > 1 && suffix.substr(1) != "iB" && suffix.substr(1) != "B")) {
+		throw std::invalid_argument("invalid size " + text);
+	}
+	return value << (10 * (unit + 1));
+}
+
+// milliseconds, or microseconds and seconds with a us or s suffix
+std::chrono::microseconds parse_latency(const std::string& text) {
+	size_t end;
+	const auto value = std::stoull(text, &end);
+	const auto suffix = text.substr(end);
+	if (suffix.empty() || suffix == "ms") {
+		return std::chrono::milliseconds(value);
+	}
+	if (suffix == "us") {
+		return std::chrono::microseconds(value);
+	}
+	if (suffix == "s") {
+		return std::chrono::seconds(value);
+	}
+	throw std::invalid_argument("invalid latency " + text);
+}
+
+Algorithm parse_hash(const std::string& name) {
+	Algorithm algorithm;
+	if (name == "sha256") {
+		algorithm = Algorithm::sha256;
+	}
+	else if (name == "blake3") {
+		algorithm = Algorithm::blake3;
+	}
+	else if (name == "xxh3") {
+		algorithm = Algorithm::xxh3;
+	}
+	else {
+		throw std::invalid_argument("unknown hash " + name);
+	}
+	if (!hrdups::available(algorithm)) {
+		throw std::invalid_argument("hash " + name + " is not available in this build");
+	}
+	return algorithm;
+}
+
+Io parse_io(const std::string& name) {
+	if (name == "read") {
+		return Io::read;
+	}
+	if (name == "mmap") {
+		return Io::mmap;
+	}
+	if (name == "uring") {
+		return Io::uring;
+	}
+	throw std::invalid_argument("unknown io backend " + name);
+}
+
+Order parse_order(const std::string& name) {
+	if (name == "walk") {
+		return Order::walk;
+	}
+	if (name == "inode") {
+		return Order::inode;
+	}
+	if (name == "physical") {
+		return Order::physical;
+	}
+	throw std::invalid_argument("unknown order " + name);
+}
+
+Mode parse_mode(const std::string& name) {
+	if (name == "hardlink") {
+		return Mode::hardlink;
+	}
+	if (name == "reflink") {
+		return Mode::reflink;
+	}
+	if (name == "dedupe-range") {
+		if (!hrdups::available(Mode::dedupe_range)) {
+			throw std::invalid_argument("mode dedupe-range is only available on Linux");
+		}
+		return Mode::dedupe_range;
+	}
+	throw std::invalid_argument("unknown mode " + name);
+}
+
+enum class Format {
+	text,
+	json,
+	csv,
+	binary,
+};
+
+Format parse_format(const std::string& name) {
+	if (name == "text") {
+		return Format::text;
+	}
+	if (name == "json") {
+		return Format::json;
+	}
+	if (name == "csv") {
+		return Format::csv;
+	}
+	if (name == "binary") {
+		return Format::binary;
+	}
+	throw std::invalid_argument("unknown report format " + name);
+}
+
+// every group found, collected in a large buffer and written in big chunks instead of a flush per path;
+// besides the text listing there are json, csv and a binary plan with the stat data needed to revalidate entries
+class Report {
+public:
+	static constexpr uint64_t magic = 0x3150535055445248; // "HRDUPSP1"
+	static constexpr uint32_t version = 2;
+
+	struct Header {
+		uint64_t magic;
+		uint32_t version;
+		uint32_t reserved;
+	};
+
+	struct GroupHeader {
+		uint64_t size;
+		hrdups::Digest digest;
+		uint32_t count; // entries that follow, the base first
+		uint32_t reserved;
+	};
+
+	struct EntryHeader {
+		uint64_t device;
+		uint64_t inode;
+		int64_t mtime;
+		int64_t ctime;
+		uint64_t links; // the ctime is only compared while the link count is still this one
+		uint32_t length; // path bytes that follow
+		uint32_t reserved;
+	};
+
+	~Report() {
+		try {
+			close();
+		}
+		catch (const std::exception & e) {
+			print_error(e.what());
+		}
+	}
+
+	void open(Format format, const std::string& path) {
+		this->format = format;
+		if (!path.empty()) {
+			this->path = path;
+			file = std::fopen(path.c_str(), "wb");
+			if (!file) {
 				std::ostringstream os;
-				std::ifstream file(entry_path, std::ifstream::ate | std::ifstream::binary);
-				const auto size = file.tellg();
+				os << "Cannot create report \"" << path << "\": " << std::strerror(errno) << ".";
+				throw std::runtime_error(os.str());
+			}
+		}
+
+		switch (format) {
+			case Format::json:
+				buffer += "[";
+				break;
+			case Format::csv:
+				buffer += "group,size,digest,role,device,inode,mtime,ctime,path\n";
+				break;
+			case Format::binary: {
+				const Header header { magic, version, 0 };
+				append(&header, sizeof(header));
+				break;
+			}
+			default:
+				break;
+		}
+	}
 
-				// skip empty files
-				if (!size) {
-					file.close();
-					continue;
+	void group(const hrdups::Group& group) {
+		std::string out;
+		std::lock_guard lock(mutex);
+		number++;
+
+		switch (format) {
+			case Format::text:
+				out += "Group " + std::to_string(number) + ":\n\t" + group.base.path.string() + "\n";
+				for (const auto & file : group.duplicates) {
+					out += "\t" + file.path.string() + "\n";
 				}
+				break;
 
-				file.seekg(std::ifstream::beg);
+			case Format::json:
+				out += number == 1 ? "\n" : ",\n";
+				out += "{\"group\":" + std::to_string(number) + ",\"size\":" + std::to_string(group.size) + ",\"digest\":\"" + hex(group.digest) + "\",\"base\":";
+				json(out, group.base);
+				out += ",\"duplicates\":[";
+				for (size_t i = 0; i < group.duplicates.size(); i++) {
+					if (i) {
+						out += ",";
+					}
+					json(out, group.duplicates[i]);
+				}
+				out += "]}";
+				break;
 
-				if (not file.good()) {
-					os << "Cannot open \"" << path << "\": " << std::strerror(errno) << ".";
-					throw std::runtime_error(os.str());
+			case Format::csv:
+				csv(out, group, "base", group.base);
+				for (const auto & file : group.duplicates) {
+					csv(out, group, "duplicate", file);
 				}
+				break;
 
-				constexpr const std::size_t buffer_size { 1 << 12 };
-				char buffer[buffer_size];
+			case Format::binary: {
+				const GroupHeader header { group.size, group.digest, static_cast<uint32_t>(group.duplicates.size() + 1), 0 };
+				out.append(reinterpret_cast<const char *>(&header), sizeof(header));
+				binary(out, group.base);
+				for (const auto & file : group.duplicates) {
+					binary(out, file);
+				}
+				break;
+			}
+		}
 
-				unsigned char hash[SHA256_DIGEST_LENGTH] = { 0 };
+		buffer += out;
+		if (buffer.size() >= flush_size) {
+			flush();
+		}
+	}
 
-				SHA256_CTX ctx;
-				SHA256_Init(&ctx);
+	void close() {
+		if (!file) {
+			return;
+		}
+		if (format == Format::json) {
+			buffer += number ? "\n]\n" : "]\n";
+		}
+		flush();
+		if (file != stdout) {
+			const bool failed = 0 != std::fclose(file);
+			file = nullptr;
+			if (failed) {
+				fail();
+			}
+		}
+		else {
+			std::fflush(file);
+			file = nullptr;
+		}
+	}
 
-				while (file.good()) {
-					file.read(buffer, buffer_size);
-					SHA256_Update(&ctx, buffer, file.gcount());
-				}
-				file.close();
+private:
+	static constexpr size_t flush_size = 1 << 20;
 
-				SHA256_Final(hash, &ctx);
+	template <typename Bytes>
+	static std::string hex(const Bytes& bytes) {
+		static const char digits[] = "0123456789abcdef";
+		std::string result;
+		for (const auto byte : bytes) {
+			result += digits[static_cast<unsigned char>(byte) >> 4];
+			result += digits[static_cast<unsigned char>(byte) & 15];
+		}
+		return result;
+	}
 
-				os << std::hex << std::setfill('0');
-				os << size;
+	// bytes of a valid utf-8 sequence starting at text[i], 0 when there is none: overlong forms, surrogates and code
+	// points past U+10FFFF are invalid as well
+	static size_t utf8_length(const std::string& text, size_t i) {
+		const auto byte = [&text](size_t at) { return static_cast<unsigned char>(text[at]); };
+		const auto lead = byte(i);
+		const size_t length = lead < 0x80 ? 1 : lead >= 0xc2 && lead <= 0xdf ? 2 : lead >= 0xe0 && lead <= 0xef ? 3 : lead >= 0xf0 && lead <= 0xf4 ? 4 : 0;
+		if (!length || i + length > text.size()) {
+			return 0;
+		}
+		for (size_t k = 1; k < length; k++) {
+			if ((byte(i + k) & 0xc0) != 0x80) {
+				return 0;
+			}
+		}
+		const auto second = byte(i + 1);
+		if ((lead == 0xe0 && second < 0xa0) || (lead == 0xed && second >= 0xa0) || (lead == 0xf0 && second < 0x90) || (lead == 0xf4 && second >= 0x90)) {
+			return 0;
+		}
+		return length;
+	}
 
-				for (unsigned char i: hash) {
-					os << std::setw(2) << static_cast<unsigned int>(i);
-				}
+	// control characters are escaped, a byte that is not part of valid utf-8 becomes U+FFFD since json cannot hold it;
+	// false when that happened and the text no longer spells the name as the filesystem stores it
+	static bool quote_json(std::string& out, const std::string& text) {
+		bool exact = true;
+		out += '"';
+		for (size_t i = 0; i < text.size();) {
+			const auto c = text[i];
+			const auto length = utf8_length(text, i);
+			if (!length) {
+				out += "\\ufffd";
+				exact = false;
+				i++;
+				continue;
+			}
+			if (c == '"' || c == '\\') {
+				out += '\\';
+				out += c;
+			}
+			else if (static_cast<unsigned char>(c) < 0x20) {
+				char escape[8];
+				std::snprintf(escape, sizeof(escape), "\\u%04x", static_cast<unsigned char>(c));
+				out += escape;
+			}
+			else {
+				out.append(text, i, length);
+			}
+			i += length;
+		}
+		out += '"';
+		return exact;
+	}
+
+	// a name that is not valid utf-8 also gets its raw bytes in hex, so a reader can still find the file
+	static void json(std::string& out, const hrdups::FileInfo& file) {
+		const auto path = file.path.string();
+		out += "{\"path\":";
+		if (!quote_json(out, path)) {
+			out += ",\"path_bytes\":\"" + hex(path) + "\"";
+		}
+		out += ",\"device\":" + std::to_string(file.device) + ",\"inode\":" + std::to_string(file.inode)
+			+ ",\"mtime\":" + std::to_string(file.mtime) + ",\"ctime\":" + std::to_string(file.ctime) + "}";
+	}
+
+	void csv(std::string& out, const hrdups::Group& group, const char *role, const hrdups::FileInfo& file) const {
+		out += std::to_string(number) + "," + std::to_string(group.size) + "," + hex(group.digest) + "," + role + ","
+			+ std::to_string(file.device) + "," + std::to_string(file.inode) + ","
+			+ std::to_string(file.mtime) + "," + std::to_string(file.ctime) + ",\"";
+		for (const auto c : file.path.string()) {
+			if (c == '"') {
+				out += '"';
+			}
+			out += c;
+		}
+		out += "\"\n";
+	}
+
+	static void binary(std::string& out, const hrdups::FileInfo& file) {
+		const auto path = file.path.string();
+		const EntryHeader header { file.device, file.inode, file.mtime, file.ctime, file.links, static_cast<uint32_t>(path.size()), 0 };
+		out.append(reinterpret_cast<const char *>(&header), sizeof(header));
+		out += path;
+	}
+
+	void append(const void *data, size_t length) {
+		buffer.append(static_cast<const char *>(data), length);
+	}
+
+	void flush() {
+		if (!buffer.empty() && buffer.size() != std::fwrite(buffer.data(), 1, buffer.size(), file)) {
+			fail();
+		}
+		buffer.clear();
+	}
+
+	[[noreturn]] void fail() const {
+		std::ostringstream os;
+		os << "Cannot write report \"" << (path.empty() ? "stdout" : path) << "\": " << std::strerror(errno) << ".";
+		throw std::runtime_error(os.str());
+	}
+
+	Format format = Format::text;
+	std::string path;
+	std::FILE *file = stdout;
+	std::string buffer;
+	long number = 0;
+	std::mutex mutex;
+};
+
+Report report;
+
+// wall and cpu time of every phase for --stats, a phase ends where the next one is marked
+class Phases {
+public:
+	void mark(const char *phase) {
+		const auto now = std::chrono::steady_clock::now();
+		const auto used = cpu();
+		times.push_back({ phase, std::chrono::duration<double>(now - last).count(), used - last_cpu });
+		last = now;
+		last_cpu = used;
+	}
+
+	// one "\t<phase>\t<seconds>s\t<seconds>s cpu" line per phase, hrdups_bench parses these
+	void print(std::ostream& out) const {
+		Time total { "total", 0, 0 };
+		out << "Stats:" << std::endl << std::fixed << std::setprecision(3);
+		for (const auto & time : times) {
+			print(out, time);
+			total.wall += time.wall;
+			total.cpu += time.cpu;
+		}
+		print(out, total);
+	}
+
+private:
+	struct Time {
+		const char *phase;
+		double wall;
+		double cpu;
+	};
 
-				auto &group = map[os.str()];
-				group.first = size;
-				group.second.emplace_back(entry_path.string());
+	// user and system time of all threads so far
+	static double cpu() {
+#ifdef _WIN32
+		FILETIME creation, exit, kernel, user;
+		if (!::GetProcessTimes(::GetCurrentProcess(), &creation, &exit, &kernel, &user)) {
+			return 0;
+		}
+		const auto seconds = [](const FILETIME& time) {
+			return static_cast<double>((static_cast<uint64_t>(time.dwHighDateTime) << 32) | time.dwLowDateTime) / 1e7;
+		};
+		return seconds(user) + seconds(kernel);
+#else
+		struct rusage usage {};
+		::getrusage(RUSAGE_SELF, &usage);
+		const auto seconds = [](const timeval& time) {
+			return static_cast<double>(time.tv_sec) + static_cast<double>(time.tv_usec) / 1e6;
+		};
+		return seconds(usage.ru_utime) + seconds(usage.ru_stime);
+#endif
+	}
+
+	static void print(std::ostream& out, const Time& time) {
+		out << '\t' << time.phase << '\t' << time.wall << "s\t" << time.cpu << "s cpu" << std::endl;
+	}
+
+	std::chrono::steady_clock::time_point last = std::chrono::steady_clock::now();
+	double last_cpu = cpu();
+	std::vector<Time> times;
+};
+
+Phases phases;
+
+void print_stats(std::ostream& out, const hrdups::Counters& counters) {
+	phases.print(out);
+	out << "\tfiles\t" << counters.files << std::endl
+	    << "\tfiltered\t" << counters.filtered << std::endl
+	    << "\thashed\t" << std::setprecision(2) << (double)counters.hashed / (1024 * 1024) << "MiB" << std::endl
+	    << "\tgroups\t" << counters.groups << std::endl
+	    << "\tlinks\t" << counters.links << std::endl
+	    << "\terrors\t" << counters.errors << std::endl;
+	counters.open.print(out, "open");
+	counters.read.print(out, "read");
+	counters.link.print(out, "link");
+}
+
+// links a plan written by --report=binary without walking or hashing anything, every link is revalidated first
+uintmax_t apply_plan(hrdups::Session& session, const std::string& file) {
+	std::ifstream plan(file, std::ifstream::binary);
+	if (not plan.good()) {
+		std::ostringstream os;
+		os << "Cannot open plan \"" << file << "\": " << std::strerror(errno) << ".";
+		throw std::runtime_error(os.str());
+	}
 
-				// std::cout << entry_path << os.str() << std::endl;
+	const auto invalid = [&file] {
+		std::ostringstream os;
+		os << "Invalid plan \"" << file << "\".";
+		return std::runtime_error(os.str());
+	};
+
+	// lengths are checked against what is left of the file before anything is allocated for them
+	plan.seekg(0, std::ifstream::end);
+	const auto total = static_cast<uint64_t>(plan.tellg());
+	plan.seekg(0);
+	const auto remaining = [&plan, total] {
+		return total - static_cast<uint64_t>(plan.tellg());
+	};
+
+	Report::Header header {};
+	if (!plan.read(reinterpret_cast<char *>(&header), sizeof(header)) || header.magic != Report::magic || header.version != Report::version) {
+		throw invalid();
+	}
+
+	std::vector<hrdups::Group> groups;
+	Report::GroupHeader group;
+	while (plan.read(reinterpret_cast<char *>(&group), sizeof(group))) {
+		if (group.count < 2 || group.count > remaining() / sizeof(Report::EntryHeader)) {
+			throw invalid();
+		}
+
+		auto &planned = groups.emplace_back();
+		planned.size = group.size;
+		planned.digest = group.digest;
+		for (uint32_t i = 0; i < group.count; i++) {
+			Report::EntryHeader entry;
+			std::string path;
+			if (!plan.read(reinterpret_cast<char *>(&entry), sizeof(entry)) || entry.length > remaining()) {
+				throw invalid();
+			}
+			path.resize(entry.length);
+			if (!plan.read(path.data(), static_cast<std::streamsize>(path.size()))) {
+				throw invalid();
+			}
+
+			const hrdups::FileInfo identity { path, group.size, entry.device, entry.inode, entry.mtime, entry.ctime, entry.links };
+			if (i == 0) {
+				planned.device = entry.device;
+				planned.base = identity;
+				continue;
 			}
+			planned.duplicates.push_back(identity);
 		}
 	}
+
+	if (!plan.eof()) {
+		throw invalid();
+	}
+	return hrdups::Linker(session).link(groups, true);
 }
 
 int main(int argc, char** argv) {
 
-	std::string path("./");
+	hrdups::Options options;
+	std::vector<std::filesystem::path> roots;
+	std::optional<Format> format;
+	std::string output;
+	std::string apply;
+	bool stats = false;
+	bool progress = false;
+	bool prune_vcs = false;
 
 	for (argv++, argc--; argc; argc--) {
-		auto option = *argv++;
-		#define set_option(name, conversion) if (0 == strcmp("--" # name, option)) { if (argc == 1) { throw std::invalid_argument("missing argument for --" # name ); } name = conversion(*argv++); argc--; }
-		#define set_bool_option(name) if (0 == strcmp("--" # name, option)) { (name) = true; }
-		set_option(path, std::string)
+		// both "--name value" and "--name=value" are accepted
+		std::string option = *argv++;
+		std::optional<std::string> argument;
+		if (const auto equals = option.find('='); equals != std::string::npos) {
+			argument = option.substr(equals + 1);
+			option.resize(equals);
+		}
+		#define set_option_named(name, variable, conversion) if (option == "--" name) { if (!argument) { if (argc == 1) { throw std::invalid_argument("missing argument for --" name); } argument = *argv++; argc--; } variable = conversion(*argument); }
+		#define set_option(name, conversion) set_option_named(# name, name, conversion)
+		#define set_bool_option_named(name, variable) if (option == "--" name) { (variable) = true; }
+		#define set_bool_option(name) set_bool_option_named(# name, name)
+		set_option_named("path", roots.emplace_back(), std::string)
+		else set_option_named("jobs", options.jobs, std::stoul)
+		else set_option_named("walkers", options.walkers, std::stoul)
+		else set_option_named("cache", options.cache, std::string)
+		else set_option_named("io", options.io, parse_io)
+		else set_option_named("hash", options.algorithm, parse_hash)
+		else set_bool_option_named("verify", options.verify)
+		else set_option_named("link-jobs", options.link_jobs, std::stoul)
+		else set_option_named("mode", options.mode, parse_mode)
+		else set_bool_option_named("stream", options.stream)
+		else set_option_named("memory-limit", options.memory_limit, parse_size)
+		else set_bool_option_named("dry-run", options.dry_run)
+		else set_option_named("report", format, parse_format)
+		else set_option(output, std::string)
+		else set_option(apply, std::string)
+		else set_bool_option(stats)
+		else set_bool_option(progress)
+		else set_bool_option_named("incremental", options.incremental)
+		else set_option_named("min-size", options.min_size, parse_size)
+		else set_option_named("max-size", options.max_size, parse_size)
+		else set_option_named("include", options.include.emplace_back(), std::string)
+		else set_option_named("exclude", options.exclude.emplace_back(), std::string)
+		else set_option_named("prune", options.prune.emplace_back(), std::string)
+		else set_bool_option_named("prune-vcs", prune_vcs)
+		else set_option_named("order", options.order, parse_order)
+		else set_option_named("io-rate", options.io_rate, parse_size)
+		else set_option_named("iops", options.iops, std::stoul)
+		else set_option_named("io-latency", options.io_latency, parse_latency)
+		else set_bool_option_named("idle-io", options.idle_io)
+		else set_option_named("nice", options.nice, std::stoi)
 		else {
-			throw std::invalid_argument("unknown option " + std::string(option));
+			throw std::invalid_argument("unknown option " + option);
 		}
 		#undef set_option
+		#undef set_option_named
+		#undef set_bool_option
+		#undef set_bool_option_named
 	}
 
-	std::cout << "Building hash map..." << std::endl;
-	try {
-		traverse(path);
+	if (options.incremental && options.cache.empty()) {
+		throw std::invalid_argument("--incremental needs --cache");
 	}
-	catch (const std::exception & e) {
-		std::cerr << e.what();
+	if (prune_vcs) {
+		options.prune.insert(options.prune.end(), { ".git", ".hg", ".svn", ".bzr", "_darcs", "CVS" });
 	}
 
-	std::cout << "Hardlinking..." << std::endl;
-	size_t saved = 0;
-	long number = 0;
+	// a machine-readable report on stdout keeps it free of progress lines
+	std::ostream& status = format && *format != Format::text && output.empty() ? std::cerr : std::cout;
+	report.open(format.value_or(Format::text), output);
 
-	for (const auto & [hash, pair] : map) {
-		const auto size = pair.first;
-		const std::string *base = nullptr;
-		bool duplicate = false;
-		for (const auto & file : pair.second) {
-			if (!base) {
-				base = &file;
-				continue;
-			}
+	hrdups::Callbacks callbacks;
+	callbacks.error = print_error;
+	callbacks.warning = print_error;
+	callbacks.group = [](const hrdups::Group& group) {
+		report.group(group);
+	};
+	callbacks.phase = [&status, &options](const char *phase) {
+		phases.mark(phase);
+		if (0 == std::strcmp(phase, "hash")) {
+			status << (options.dry_run ? "Planning..." : options.mode == Mode::hardlink ? "Hardlinking..." : "Cloning...") << std::endl;
+		}
+	};
+	hrdups::Session session(options, callbacks);
 
-			if (!duplicate) {
-				duplicate = true;
-				number++;
-				std::cout << "Group " << number << ":" << std::endl << "\t" << *base << std::endl;
-			}
-			std::cout << "\t" << file << std::endl;
+	Progress meter;
+	if (progress) {
+		meter.start(session.counters(), std::chrono::seconds(1));
+	}
 
-			if (0 != std::remove(file.c_str())) {
-				std::ostringstream os;
-				os << "Cannot delete file \"" << file << "\": " << std::strerror(errno) << ".";
-				throw std::runtime_error(os.str());
-			}
+	const auto done = [&](uintmax_t saved) {
+		status << "Done!" << std::endl << (options.dry_run ? "Would save " : "Saved ") << std::fixed << std::setprecision(2) << (double)saved / (1024 * 1024) << "MiB" << std::endl;
+		if (stats) {
+			print_stats(status, session.counters());
+		}
+	};
 
-			std::error_code ec;
-			std::filesystem::create_hard_link(std::filesystem::path(base->c_str()), std::filesystem::path(file.c_str()), ec);
-			if (ec.value() != 0) {
-				std::ostringstream os;
-				os << "Cannot create hardlink for \"" << *base << " as " << file << "\": " << ec.message() << ".";
-				throw std::runtime_error(os.str());
-			}
+	if (!apply.empty()) {
+		status << "Applying plan..." << std::endl;
+		const auto saved = apply_plan(session, apply);
+		phases.mark("link");
+		done(saved);
+		return 0;
+	}
 
-			saved += size;
-		}
+	if (roots.empty()) {
+		roots.emplace_back("./");
+	}
+
+#ifndef _WIN32
+	// every thread keeps a few directories open, so the soft descriptor limit is raised as far as allowed
+	if (struct rlimit limit {}; 0 == ::getrlimit(RLIMIT_NOFILE, &limit) && limit.rlim_cur < limit.rlim_max) {
+		limit.rlim_cur = limit.rlim_max;
+		::setrlimit(RLIMIT_NOFILE, &limit);
 	}
+#endif
 
-	std::cout << "Done!" << std::endl << "Saved " << std::fixed << std::setprecision(2) << (double)saved / (1024 * 1024) << "MiB" << std::endl;
+	status << (options.stream ? "Streaming..." : "Building hash map...") << std::endl;
+	const auto saved = session.deduplicate(roots);
+	report.close();
+	done(saved);
 	return 0;
 }